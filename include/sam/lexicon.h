@@ -0,0 +1,78 @@
+#ifndef SAM_LEXICON_H_
+#define SAM_LEXICON_H_
+
+#include "sam.h"
+#include "offsetmap.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// User pronunciation lexicon, compiled into an Aho-Corasick automaton so
+/// that rewriting text is a single pass whose cost doesn't depend on the
+/// number of entries.
+///
+/// The source file has one <c>pattern = replacement</c> entry per line.
+/// Blank lines and lines starting with \c # are ignored. Patterns match
+/// case-insensitively, and a pattern that starts or ends with a letter or
+/// digit only matches on a word boundary. Replacements are passed to the
+/// engine as tagged text, so they can use SAPI4 tags such as \c \\Pron=...\\.
+class Lexicon {
+public:
+  /// Load a lexicon from \p path. The compiled automaton is cached next to
+  /// it in <c>path.cache</c> and reused while the source is unchanged.
+  bool load(const std::filesystem::path &path);
+
+  /// Rewrite every match in \p text, preferring the leftmost and then the
+  /// longest match.
+  /// \param offsets If not null, receives a map from offsets in the
+  ///        rewritten text to offsets in the original.
+  void apply(std::wstring &text, OffsetMap *offsets = nullptr) const;
+
+  size_t size() const {
+    return _offsets.empty() ? 0 : _offsets.size() - 1;
+  }
+
+  explicit operator bool() const {
+    return !_nodes.empty();
+  }
+
+private:
+  struct Node {
+    uint32_t edgeBegin;
+    uint32_t edgeCount;
+    uint32_t fail;
+    /// Nearest node on the fail chain with an output, or 0 for none.
+    uint32_t dict;
+    /// Entry index, or \c NoOutput.
+    uint32_t output;
+    uint32_t depth;
+  };
+
+  struct Edge {
+    wchar_t ch;
+    uint32_t target;
+  };
+
+  static constexpr uint32_t NoOutput = UINT32_MAX;
+
+  bool compile(const std::filesystem::path &path);
+  bool readCache(const std::filesystem::path &path, uint64_t sourceSize,
+                 int64_t sourceTime);
+  bool writeCache(const std::filesystem::path &path, uint64_t sourceSize,
+                  int64_t sourceTime) const;
+  uint32_t next(uint32_t node, wchar_t ch) const;
+
+  std::vector<Node> _nodes;
+  std::vector<Edge> _edges;
+  /// Replacement \c i is <c>_replacements[_offsets[i], _offsets[i+1])</c>.
+  std::vector<uint32_t> _offsets;
+  std::wstring _replacements;
+  /// Whether the pattern for each entry starts or ends with a word
+  /// character (bit 0 and bit 1).
+  std::vector<uint8_t> _boundaries;
+};
+
+#endif /* SAM_LEXICON_H_ */
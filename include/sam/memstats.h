@@ -0,0 +1,96 @@
+#ifndef SAM_MEMSTATS_H_
+#define SAM_MEMSTATS_H_
+
+#include <cstddef>
+
+// Opt-in heap instrumentation. Build with -DSAM_MEMSTATS=ON to replace the
+// global allocator with a counting one; otherwise everything here compiles
+// down to nothing.
+namespace MemStats {
+
+/// Heap activity observed between two points in time.
+struct Counters {
+  size_t allocs = 0;
+  size_t bytes = 0;
+  /// High-water mark of live heap bytes above the starting point.
+  size_t peakBytes = 0;
+  /// Highest working set seen above the starting point. The working set is
+  /// only sampled where stages begin and end, so this can miss short spikes
+  /// inside a stage with no stages of its own.
+  size_t peakRss = 0;
+};
+
+#ifdef SAM_MEMSTATS
+
+constexpr bool enabled = true;
+
+/// Allocator state captured at the start of a stage or utterance.
+struct Mark {
+  size_t allocs;
+  size_t bytes;
+  size_t live;
+  size_t savedPeak;
+  size_t rss;
+  size_t savedPeakRss;
+};
+
+/// Attributes heap activity to a named stage for the lifetime of the object.
+/// Stages nest, and counts are inclusive of any inner stages. \p name must
+/// have static storage duration.
+class Stage {
+public:
+  explicit Stage(const char *name) noexcept;
+  Stage(const Stage &) = delete;
+  Stage &operator=(const Stage &) = delete;
+  ~Stage();
+
+private:
+  const char *_name;
+  Mark _mark;
+};
+
+/// Brackets a single utterance. Stages opened while an utterance is active
+/// are also reported in the utterance's summary, which is logged when the
+/// object is destroyed.
+class Utterance {
+public:
+  explicit Utterance() noexcept;
+  Utterance(const Utterance &) = delete;
+  Utterance &operator=(const Utterance &) = delete;
+  ~Utterance();
+
+private:
+  Mark _mark;
+};
+
+/// Fail utterances that allocate more than \p bytes in total or make more
+/// than \p allocs allocations. Zero disables either check.
+void setBudget(size_t bytes, size_t allocs);
+
+/// \return true if any utterance so far exceeded the budget.
+bool overBudget();
+
+/// Log per-stage totals for the whole run and the process' peak working set.
+void printSummary();
+
+#else
+
+constexpr bool enabled = false;
+
+struct Stage {
+  explicit Stage(const char *) noexcept {}
+};
+
+struct Utterance {
+  explicit Utterance() noexcept {}
+};
+
+static inline void setBudget(size_t, size_t) {}
+static inline bool overBudget() { return false; }
+static inline void printSummary() {}
+
+#endif
+
+} // namespace MemStats
+
+#endif /* SAM_MEMSTATS_H_ */
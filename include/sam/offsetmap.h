@@ -0,0 +1,44 @@
+#ifndef SAM_OFFSETMAP_H_
+#define SAM_OFFSETMAP_H_
+
+#include <cstdint>
+#include <vector>
+
+/// Maps character offsets in rewritten text back to the text it was made
+/// from. Stored as points sorted on both coordinates; between two points
+/// the offsets advance together. An empty map is the identity.
+class OffsetMap {
+public:
+  struct Point {
+    uint32_t output;
+    uint32_t source;
+  };
+
+  /// Output offset \p output starts at source offset \p source. Points must
+  /// be added in order; a later point at the same output offset replaces
+  /// the earlier one.
+  void add(uint32_t output, uint32_t source);
+
+  /// Add every point of \p other with its output offsets moved by \p base.
+  void append(const OffsetMap &other, uint32_t base);
+
+  uint32_t toSource(uint32_t output) const;
+  uint32_t toOutput(uint32_t source) const;
+
+  /// \return a map from the output of \p outer to the source of \p inner,
+  /// where the source of \p outer is the output of \p inner.
+  static OffsetMap compose(const OffsetMap &outer, const OffsetMap &inner);
+
+  bool empty() const {
+    return _points.empty();
+  }
+
+  void clear() {
+    _points.clear();
+  }
+
+private:
+  std::vector<Point> _points;
+};
+
+#endif /* SAM_OFFSETMAP_H_ */
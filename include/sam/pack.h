@@ -0,0 +1,187 @@
+#ifndef SAM_PACK_H_
+#define SAM_PACK_H_
+
+#include "sam.h"
+#include "wav.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// A pack is a single file holding many rendered utterances. It is a sequence
+// of self-describing blocks: each utterance is appended as a record block,
+// and closing a writer appends an index block whose trailer is the last
+// thing in the file. Nothing is ever rewritten in place, and a block only
+// counts as written once it has been flushed to disk, so a crash or power
+// loss can only lose the tail; readers fall back to scanning the records
+// when the file doesn't end in a valid index.
+namespace Pack {
+
+enum BlockType : uint32_t {
+  RecordBlock = 1,
+  IndexBlock  = 2,
+};
+
+/// Blocks start on a multiple of \c BlockAlign bytes.
+constexpr uint64_t BlockAlign = 8;
+
+struct BlockHeader {
+  uint32_t magic;
+  uint32_t type;
+  /// Size of the block, header and padding included.
+  uint64_t size;
+};
+
+/// Follows the block header of a record, then come \c keyLength UTF-16
+/// characters of key and \c dataLength bytes of sample data.
+struct RecordHeader {
+  uint32_t keyLength;
+  uint32_t dataLength;
+  uint32_t durationMs;
+  uint32_t sampleRate;
+  uint32_t byteRate;
+  uint16_t formatTag;
+  uint16_t channels;
+  uint16_t blockAlign;
+  uint16_t bitsPerSample;
+};
+
+/// One entry of the index, which is sorted by \c keyHash. Keys whose hashes
+/// collide each get their own entry. The format is repeated from the record
+/// so that it can be checked without paging the record in.
+struct IndexEntry {
+  uint64_t keyHash;
+  /// File offset of the record's block header.
+  uint64_t recordOffset;
+  uint32_t dataLength;
+  uint32_t durationMs;
+  uint32_t sampleRate;
+  uint32_t byteRate;
+  uint16_t formatTag;
+  uint16_t channels;
+  uint16_t blockAlign;
+  uint16_t bitsPerSample;
+};
+
+/// Last bytes of the file when it was closed cleanly.
+struct Trailer {
+  uint64_t indexOffset;
+  char magic[8];
+};
+
+uint64_t hashKey(std::wstring_view key);
+
+/// An utterance served straight out of the mapped pack.
+struct Slice {
+  std::wstring_view key;
+  WavInfo format;
+  const uint8_t *data;
+};
+
+/// Memory-mapped, read-only view of a pack.
+class Reader {
+public:
+  Reader() = default;
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+  ~Reader();
+
+  bool open(const std::filesystem::path &path);
+  void close();
+
+  /// Find the latest utterance stored under \p key.
+  bool find(std::wstring_view key, Slice &slice) const;
+
+  /// Read the record an index entry points at.
+  bool slice(const IndexEntry &entry, Slice &slice) const;
+
+  /// Live entries, one per key, sorted by key hash.
+  const IndexEntry *begin() const {
+    return _index;
+  }
+
+  const IndexEntry *end() const {
+    return _index + _count;
+  }
+
+  size_t size() const {
+    return _count;
+  }
+
+  /// File size after the last complete block.
+  uint64_t validLength() const {
+    return _validLength;
+  }
+
+  /// Whether everything after validLength() looks like a single append
+  /// that was cut short, as opposed to corruption or a file that isn't a
+  /// pack.
+  bool tornTail() const {
+    return _tornTail;
+  }
+
+  /// Whether the index came from the footer rather than a scan.
+  bool hasFooter() const {
+    return _hasFooter;
+  }
+
+private:
+  bool readFooter();
+  void scan();
+
+  HANDLE _file = INVALID_HANDLE_VALUE;
+  HANDLE _mapping = nullptr;
+  const uint8_t *_base = nullptr;
+  uint64_t _length = 0;
+  uint64_t _validLength = 0;
+  bool _hasFooter = false;
+  bool _tornTail = false;
+
+  const IndexEntry *_index = nullptr;
+  size_t _count = 0;
+  /// Index rebuilt by scanning when the footer is missing.
+  std::vector<IndexEntry> _scanned;
+};
+
+/// Appends utterances to a pack, creating it if needed.
+class Writer {
+public:
+  Writer() = default;
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+  ~Writer() {
+    close();
+  }
+
+  bool open(const std::filesystem::path &path);
+
+  /// Append sample data in \p format under \p key and flush it to disk. A
+  /// later record with the same key replaces earlier ones.
+  bool add(std::wstring_view key, const WavInfo &format, const uint8_t *data,
+           uint32_t length);
+
+  /// Append the sample data of the WAV file at \p wavPath.
+  bool add(std::wstring_view key, const std::filesystem::path &wavPath);
+
+  /// Write the index, flush it to disk and close the file.
+  bool close();
+
+private:
+  bool writeBlock(const std::vector<uint8_t> &block);
+
+  HANDLE _file = INVALID_HANDLE_VALUE;
+  uint64_t _offset = 0;
+  /// Latest record for each key.
+  std::map<std::wstring, IndexEntry> _entries;
+  std::vector<uint8_t> _block;
+  /// Whether the file already ends in an index that covers every record.
+  bool _indexed = false;
+};
+
+} // namespace Pack
+
+#endif /* SAM_PACK_H_ */
@@ -0,0 +1,71 @@
+#ifndef SAM_SEEKINDEX_H_
+#define SAM_SEEKINDEX_H_
+
+#include "offsetmap.h"
+#include "tts.h"
+#include "wav.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+/// Sorted map from sentence, paragraph and chapter starts in the source
+/// text to positions in the rendered WAV file, so a player can start in the
+/// middle of a long render without synthesizing it again.
+class SeekIndex {
+public:
+  enum Kind : uint32_t {
+    Sentence  = 1,
+    Paragraph = 2,
+    Chapter   = 4,
+  };
+
+  struct Entry {
+    /// Offset into the source text, in characters.
+    uint32_t textOffset;
+    /// Offset into the WAV sample data, in bytes.
+    uint32_t byteOffset;
+    /// Combination of \c Kind flags.
+    uint32_t kind;
+  };
+
+  /// Byte range in the WAV file, relative to the start of the file.
+  struct Range {
+    uint32_t begin;
+    uint32_t end;
+    uint32_t kind;
+  };
+
+  /// Build the index for \p text, rendered into the file described by
+  /// \p wav.
+  /// \param words Word timing reported while rendering \p text.
+  /// \param startTime Timestamp of the engine's AudioStart notification.
+  /// \param sourceOffsets Maps offsets in \p text back to the source text
+  ///        it was rewritten from, which is what the index stores.
+  void build(std::wstring_view text,
+             const std::vector<BufNotifySink::WordTiming> &words,
+             QWORD startTime, const WavInfo &wav,
+             const OffsetMap &sourceOffsets);
+
+  bool write(const std::filesystem::path &path) const;
+  bool load(const std::filesystem::path &path);
+
+  /// Find the segment containing \p textOffset: it starts at the last entry
+  /// at or before \p textOffset and ends where the next entry starts.
+  bool lookup(uint32_t textOffset, Range &range) const;
+
+  const std::vector<Entry> &entries() const {
+    return _entries;
+  }
+
+  /// \return the index path that goes with the WAV file \p wavPath.
+  static std::filesystem::path pathFor(const std::filesystem::path &wavPath);
+
+private:
+  std::vector<Entry> _entries;
+  uint32_t _dataOffset = 0;
+  uint32_t _dataLength = 0;
+};
+
+#endif /* SAM_SEEKINDEX_H_ */
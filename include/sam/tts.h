@@ -1,7 +1,11 @@
+#ifndef SAM_TTS_H_
+#define SAM_TTS_H_
+
 #include "sam.h"
 
 #include <speech.h>
 #include <string_view>
+#include <vector>
 
 const WORD RealTime = (WORD)-1;
 
@@ -23,6 +27,12 @@ public:
     return _finishEvent;
   }
 
+  /// Timestamp of the last AudioStart notification. Engine timestamps are
+  /// positions in the audio destination's byte stream.
+  QWORD audioStartTime() const {
+    return _audioStartTime;
+  }
+
   bool finished() const {
     switch (auto r = WaitForSingleObject(_finishEvent, 0)) {
       case WAIT_OBJECT_0:
@@ -49,6 +59,41 @@ public:
 private:
   ULONG _refcnt = 1;
   HANDLE _finishEvent;
+  QWORD _audioStartTime = 0;
+};
+
+/// Collects per-word timing for a single TextData call.
+class BufNotifySink : public ITTSBufNotifySink {
+public:
+  struct WordTiming {
+    /// Offset into the submitted text, in bytes.
+    DWORD byteOffset;
+    QWORD timeStamp;
+  };
+
+  explicit BufNotifySink() noexcept = default;
+  virtual ~BufNotifySink() = default;
+
+  STDMETHOD( QueryInterface)(REFIID riid, LPVOID *ppv);
+  STDMETHOD_(ULONG,  AddRef)();
+  STDMETHOD_(ULONG, Release)();
+
+  STDMETHOD   (TextDataDone)(QWORD, DWORD);
+  STDMETHOD(TextDataStarted)(QWORD);
+  STDMETHOD       (BookMark)(QWORD, DWORD);
+  STDMETHOD   (WordPosition)(QWORD, DWORD);
+
+  const std::vector<WordTiming> &wordTimings() const {
+    return _wordTimings;
+  }
+
+  void clear() {
+    _wordTimings.clear();
+  }
+
+private:
+  ULONG _refcnt = 1;
+  std::vector<WordTiming> _wordTimings;
 };
 
 struct TTSContainer {
@@ -64,8 +109,9 @@ struct TTSContainer {
    */
   HRESULT init(std::wstring_view name, std::wstring_view outputFilename);
   HRESULT listVoices() const;
+  /// \param bufSink If not null, receives word timing for \p text.
   void say(std::wstring_view text, NotifySink &sink,
-           WORD pitch = 0, DWORD speed = 0);
+           WORD pitch = 0, DWORD speed = 0, BufNotifySink *bufSink = nullptr);
 
   PITTSCENTRAL ttsCentral() const {
     return _ttsCentral;
@@ -83,6 +129,12 @@ struct TTSContainer {
     return !_outputFilename.empty();
   }
 
+  /// Redirect file output for subsequent calls to say(). Only valid when
+  /// the container was initialized with file output.
+  void setOutputFilename(std::wstring_view outputFilename) {
+    _outputFilename = outputFilename;
+  }
+
   /// \return a tuple of <c>[min pitch, max pitch, default pitch]</c>.
   std::tuple<WORD, WORD, WORD> pitchInfo() const {
     return std::make_tuple(_minPitch, _maxPitch, _defaultPitch);
@@ -112,3 +164,4 @@ private:
   DWORD _maxSpeed;
 };
 
+#endif /* SAM_TTS_H_ */
@@ -0,0 +1,96 @@
+#ifndef SAM_VOICEPOOL_H_
+#define SAM_VOICEPOOL_H_
+
+#include "tts.h"
+#include "offsetmap.h"
+
+#include <list>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/// Settings that inline voice markers can change.
+struct VoiceSettings {
+  std::wstring voice;
+  int pitch;
+  int speed;
+
+  bool operator==(const VoiceSettings &other) const {
+    return voice == other.voice && pitch == other.pitch
+        && speed == other.speed;
+  }
+  bool operator!=(const VoiceSettings &other) const {
+    return !(*this == other);
+  }
+};
+
+/// Part of a document spoken with a single voice.
+struct VoiceSegment : VoiceSettings {
+  std::wstring text;
+  /// Maps offsets in \c text to offsets in the document it was split from.
+  OffsetMap sourceOffsets;
+};
+
+/// Split \p text on inline voice markers of the form
+/// <c>[[voice=Mary; pitch=120; speed=150]]</c>. Any key may be left out, a
+/// bare value selects a voice, and an empty marker <c>[[]]</c> goes back to
+/// the defaults. Settings carry over from one segment to the next, and
+/// adjacent segments with the same settings are joined.
+/// \param current The settings in effect at the start of \p text. Receives
+///        the settings in effect at its end, so that they can carry over to
+///        the next document.
+std::vector<VoiceSegment> splitVoiceSegments(std::wstring_view text,
+                                             const VoiceSettings &defaults,
+                                             VoiceSettings &current);
+
+/// Initialized engines keyed by voice, so that switching back and forth
+/// between voices doesn't pay for TTSContainer::init every time. Pitch and
+/// speed are set on each TTSContainer::say, so they don't need an engine of
+/// their own. The least recently used engine is released once the pool is
+/// over capacity.
+class VoicePool {
+public:
+  struct Engine {
+    std::wstring voice;
+    TTSContainer tts;
+    /// File this engine renders a segment into before it's appended to
+    /// the real output, or empty when playing through the speakers.
+    std::wstring partFilename;
+  };
+
+  explicit VoicePool(size_t capacity, std::wstring_view outputFilename);
+  VoicePool(const VoicePool &) = delete;
+  VoicePool &operator=(const VoicePool &) = delete;
+  ~VoicePool();
+
+  /// \return a ready engine for \p voice, or null if it couldn't be
+  /// initialized.
+  Engine *acquire(std::wstring_view voice);
+
+  bool isFileOutput() const {
+    return !_outputFilename.empty();
+  }
+
+  const std::wstring &outputFilename() const {
+    return _outputFilename;
+  }
+
+  /// Log hit rate and time spent initializing engines.
+  void logStats() const;
+
+private:
+  void evict();
+
+  /// Most recently used first.
+  std::list<Engine> _engines;
+  size_t _capacity;
+  std::wstring _outputFilename;
+  unsigned _nextPart = 0;
+
+  size_t _hits = 0;
+  size_t _misses = 0;
+  size_t _evictions = 0;
+  double _initSeconds = 0;
+};
+
+#endif /* SAM_VOICEPOOL_H_ */
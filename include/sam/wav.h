@@ -0,0 +1,68 @@
+#ifndef SAM_WAV_H_
+#define SAM_WAV_H_
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+
+/// Layout of a RIFF WAVE file, as far as the rest of the program cares.
+struct WavInfo {
+  uint16_t formatTag = 0;
+  uint16_t channels = 0;
+  uint32_t sampleRate = 0;
+  uint32_t byteRate = 0;
+  uint16_t blockAlign = 0;
+  uint16_t bitsPerSample = 0;
+  /// File offset of the first byte of sample data.
+  uint32_t dataOffset = 0;
+  /// Length of the sample data in bytes.
+  uint32_t dataLength = 0;
+};
+
+/// Read the format and locate the \c data chunk of a WAV file.
+bool readWavInfo(const std::filesystem::path &path, WavInfo &info);
+
+/// \return true if sample data in formats \p a and \p b can be concatenated.
+bool sameWavFormat(const WavInfo &a, const WavInfo &b);
+
+/// Writes a PCM WAV file by concatenating the sample data of other WAV files.
+class WavWriter {
+public:
+  WavWriter() = default;
+  WavWriter(const WavWriter &) = delete;
+  WavWriter &operator=(const WavWriter &) = delete;
+  ~WavWriter() {
+    close();
+  }
+
+  bool open(const std::filesystem::path &path, const WavInfo &format);
+
+  /// Append the sample data of the file at \p path, which must have the
+  /// format the writer was opened with.
+  bool append(const std::filesystem::path &path, const WavInfo &info);
+
+  /// Append \p length bytes of sample data in the writer's format.
+  bool write(const void *data, uint32_t length);
+
+  /// Fill in the chunk sizes and close the file.
+  bool close();
+
+  bool isOpen() const {
+    return _out.is_open();
+  }
+
+  const WavInfo &format() const {
+    return _format;
+  }
+
+  /// Bytes of sample data written so far.
+  uint32_t dataLength() const {
+    return _format.dataLength;
+  }
+
+private:
+  std::ofstream _out;
+  WavInfo _format;
+};
+
+#endif /* SAM_WAV_H_ */
@@ -0,0 +1,396 @@
+#include "sam/lexicon.h"
+#include "sam/memstats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <cstring>
+#include <cwctype>
+
+namespace {
+
+const char CacheMagic[8] = {'S', 'A', 'M', 'L', 'E', 'X', '1', 0};
+
+struct CacheHeader {
+  char magic[8];
+  uint64_t sourceSize;
+  int64_t sourceTime;
+  uint32_t nodeCount;
+  uint32_t edgeCount;
+  uint32_t entryCount;
+  uint32_t replacementLength;
+};
+
+// Apostrophes count as boundaries, so that an entry for a name also
+// matches its possessive.
+bool isWordChar(wchar_t ch) {
+  return iswalnum(ch);
+}
+
+std::wstring_view trim(std::wstring_view s) {
+  while (!s.empty() && iswspace(s.front())) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && iswspace(s.back())) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+template<typename T>
+bool readVector(std::ifstream &in, std::vector<T> &v, size_t count) {
+  v.resize(count);
+  in.read(reinterpret_cast<char *>(v.data()), count * sizeof(T));
+  return in.good();
+}
+
+template<typename T>
+void writeVector(std::ofstream &out, const std::vector<T> &v) {
+  out.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+} // anonymous namespace
+
+bool Lexicon::load(const std::filesystem::path &path) {
+  std::error_code ec;
+  auto sourceSize = std::filesystem::file_size(path, ec);
+  if (ec) {
+    Log::error(L"Couldn't open lexicon file {}.", path.wstring());
+    return false;
+  }
+  auto sourceTime = static_cast<int64_t>(
+    std::filesystem::last_write_time(path, ec).time_since_epoch().count());
+
+  auto cachePath = path;
+  cachePath += L".cache";
+  if (readCache(cachePath, sourceSize, sourceTime)) {
+    Log::debug("Loaded {} lexicon entries from cache.", size());
+    return true;
+  }
+
+  if (!compile(path)) {
+    return false;
+  }
+  Log::debug("Compiled {} lexicon entries into {} states.", size(),
+             _nodes.size());
+  if (!writeCache(cachePath, sourceSize, sourceTime)) {
+    Log::warn(L"Couldn't write lexicon cache {}.", cachePath.wstring());
+  }
+  return true;
+}
+
+bool Lexicon::compile(const std::filesystem::path &path) {
+  std::wifstream input(path);
+  if (!input.good()) {
+    Log::error(L"Couldn't open lexicon file {}.", path.wstring());
+    return false;
+  }
+
+  // Sorting the patterns lets the trie be built with every node's edges
+  // already in order, since a new edge can only ever follow the last one.
+  std::map<std::wstring, std::wstring> entries;
+  std::wstring line;
+  size_t lineNumber = 0;
+  while (std::getline(input, line)) {
+    ++lineNumber;
+    auto text = trim(line);
+    if (text.empty() || text[0] == L'#') {
+      continue;
+    }
+    auto eq = text.find(L'=');
+    if (eq == std::wstring_view::npos) {
+      Log::warn("Lexicon line {}: expected 'pattern = replacement'.",
+                lineNumber);
+      continue;
+    }
+    auto pattern = trim(text.substr(0, eq));
+    if (pattern.empty()) {
+      Log::warn("Lexicon line {}: empty pattern.", lineNumber);
+      continue;
+    }
+    std::wstring key{pattern};
+    for (auto &ch : key) {
+      ch = towlower(ch);
+    }
+    entries[std::move(key)] = trim(text.substr(eq + 1));
+  }
+
+  struct BuildNode {
+    std::vector<Edge> edges;
+    uint32_t output = NoOutput;
+    uint32_t depth = 0;
+  };
+  std::vector<BuildNode> trie(1);
+
+  _offsets.clear();
+  _replacements.clear();
+  _boundaries.clear();
+  _offsets.reserve(entries.size() + 1);
+  _boundaries.reserve(entries.size());
+  for (auto &[pattern, replacement] : entries) {
+    uint32_t node = 0;
+    for (auto ch : pattern) {
+      auto &edges = trie[node].edges;
+      if (!edges.empty() && edges.back().ch == ch) {
+        node = edges.back().target;
+        continue;
+      }
+      auto child = static_cast<uint32_t>(trie.size());
+      edges.push_back(Edge{ch, child});
+      trie.emplace_back();
+      trie[child].depth = trie[node].depth + 1;
+      node = child;
+    }
+    trie[node].output = static_cast<uint32_t>(_offsets.size());
+    _offsets.push_back(static_cast<uint32_t>(_replacements.size()));
+    _replacements += replacement;
+    _boundaries.push_back(uint8_t(
+      (isWordChar(pattern.front()) ? 1 : 0) |
+      (isWordChar(pattern.back()) ? 2 : 0)));
+  }
+  _offsets.push_back(static_cast<uint32_t>(_replacements.size()));
+
+  _nodes.assign(trie.size(), Node{});
+  _edges.clear();
+  for (size_t i = 0; i < trie.size(); ++i) {
+    auto &node = _nodes[i];
+    node.edgeBegin = static_cast<uint32_t>(_edges.size());
+    node.edgeCount = static_cast<uint32_t>(trie[i].edges.size());
+    node.output = trie[i].output;
+    node.depth = trie[i].depth;
+    _edges.insert(_edges.end(), trie[i].edges.begin(), trie[i].edges.end());
+  }
+  trie.clear();
+
+  // Breadth-first so that every fail target is finished before it's used.
+  std::vector<uint32_t> queue;
+  queue.reserve(_nodes.size());
+  queue.push_back(0);
+  for (size_t head = 0; head < queue.size(); ++head) {
+    auto u = queue[head];
+    auto &parent = _nodes[u];
+    for (uint32_t e = 0; e < parent.edgeCount; ++e) {
+      auto &edge = _edges[parent.edgeBegin + e];
+      auto &child = _nodes[edge.target];
+      if (u == 0) {
+        child.fail = 0;
+      } else {
+        uint32_t f = parent.fail;
+        uint32_t t;
+        while ((t = next(f, edge.ch)) == 0 && f != 0) {
+          f = _nodes[f].fail;
+        }
+        child.fail = t;
+      }
+      auto &fail = _nodes[child.fail];
+      child.dict = fail.output != NoOutput ? child.fail : fail.dict;
+      queue.push_back(edge.target);
+    }
+  }
+
+  return true;
+}
+
+uint32_t Lexicon::next(uint32_t node, wchar_t ch) const {
+  auto &n = _nodes[node];
+  auto begin = _edges.begin() + n.edgeBegin;
+  auto end = begin + n.edgeCount;
+  auto it = std::lower_bound(begin, end, ch,
+                             [](const Edge &e, wchar_t c) { return e.ch < c; });
+  if (it != end && it->ch == ch) {
+    return it->target;
+  }
+  return 0;
+}
+
+void Lexicon::apply(std::wstring &text, OffsetMap *offsets) const {
+  if (offsets) {
+    offsets->clear();
+  }
+  if (_nodes.empty() || text.empty()) {
+    return;
+  }
+  MemStats::Stage stage{"lexicon"};
+
+  // Longest acceptable match starting at each position, found in one pass.
+  struct Match {
+    uint32_t length;
+    uint32_t entry;
+  };
+  std::vector<Match> matches;
+  const auto length = text.length();
+  uint32_t state = 0;
+  for (size_t i = 0; i < length; ++i) {
+    auto ch = static_cast<wchar_t>(towlower(text[i]));
+    uint32_t t;
+    while ((t = next(state, ch)) == 0 && state != 0) {
+      state = _nodes[state].fail;
+    }
+    state = t;
+
+    auto m = _nodes[state].output != NoOutput ? state : _nodes[state].dict;
+    for (; m != 0; m = _nodes[m].dict) {
+      auto &node = _nodes[m];
+      auto start = i + 1 - node.depth;
+      auto bounds = _boundaries[node.output];
+      if ((bounds & 1) && start > 0 && isWordChar(text[start - 1])) {
+        continue;
+      }
+      if ((bounds & 2) && i + 1 < length && isWordChar(text[i + 1])) {
+        continue;
+      }
+      if (matches.empty()) {
+        matches.resize(length, Match{0, 0});
+      }
+      if (node.depth > matches[start].length) {
+        matches[start] = Match{node.depth, node.output};
+      }
+    }
+  }
+
+  if (matches.empty()) {
+    return;
+  }
+
+  std::wstring result;
+  result.reserve(length);
+  for (size_t i = 0; i < length;) {
+    auto &match = matches[i];
+    if (!match.length) {
+      result += text[i++];
+      continue;
+    }
+    if (offsets) {
+      offsets->add(static_cast<uint32_t>(result.length()),
+                   static_cast<uint32_t>(i));
+    }
+    result.append(_replacements, _offsets[match.entry],
+                  _offsets[match.entry + 1] - _offsets[match.entry]);
+    i += match.length;
+    if (offsets) {
+      offsets->add(static_cast<uint32_t>(result.length()),
+                   static_cast<uint32_t>(i));
+    }
+  }
+  text = std::move(result);
+}
+
+bool Lexicon::readCache(const std::filesystem::path &path,
+                        uint64_t sourceSize, int64_t sourceTime)
+{
+  std::error_code ec;
+  auto cacheSize = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return false;
+  }
+  std::ifstream in(path, std::ios::binary);
+  if (!in.good()) {
+    return false;
+  }
+
+  CacheHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in.good()
+      || memcmp(header.magic, CacheMagic, sizeof(CacheMagic))
+      || header.sourceSize != sourceSize
+      || header.sourceTime != sourceTime) {
+    return false;
+  }
+
+  auto corrupt = [&]() {
+    Log::warn(L"Lexicon cache {} is corrupt; recompiling.", path.wstring());
+    _nodes.clear();
+    return false;
+  };
+
+  // Check the counts against the file before trusting them with a resize.
+  uint64_t expectedSize = sizeof(CacheHeader)
+    + uint64_t(header.nodeCount) * sizeof(Node)
+    + uint64_t(header.edgeCount) * sizeof(Edge)
+    + (uint64_t(header.entryCount) + 1) * sizeof(uint32_t)
+    + uint64_t(header.entryCount) * sizeof(uint8_t)
+    + uint64_t(header.replacementLength) * sizeof(wchar_t);
+  if (header.nodeCount == 0 || expectedSize != cacheSize) {
+    return corrupt();
+  }
+
+  std::vector<uint32_t> offsets;
+  if (!readVector(in, _nodes, header.nodeCount)
+      || !readVector(in, _edges, header.edgeCount)
+      || !readVector(in, offsets, size_t(header.entryCount) + 1)
+      || !readVector(in, _boundaries, header.entryCount)) {
+    return corrupt();
+  }
+  _offsets = std::move(offsets);
+  _replacements.resize(header.replacementLength);
+  in.read(reinterpret_cast<char *>(_replacements.data()),
+          header.replacementLength * sizeof(wchar_t));
+  if (!in.good()) {
+    return corrupt();
+  }
+
+  if (_offsets.front() != 0 || _offsets.back() > header.replacementLength) {
+    return corrupt();
+  }
+  for (size_t i = 1; i < _offsets.size(); ++i) {
+    if (_offsets[i] < _offsets[i - 1]) {
+      return corrupt();
+    }
+  }
+
+  // apply() relies on depths to find where a match starts, and on fail and
+  // dictionary links always leading to shallower nodes so that following
+  // them terminates.
+  const auto nodeCount = _nodes.size();
+  if (_nodes[0].depth != 0 || _nodes[0].output != NoOutput
+      || _nodes[0].fail != 0 || _nodes[0].dict != 0) {
+    return corrupt();
+  }
+  for (size_t i = 0; i < nodeCount; ++i) {
+    auto &node = _nodes[i];
+    if (size_t(node.edgeBegin) + node.edgeCount > _edges.size()
+        || node.fail >= nodeCount || node.dict >= nodeCount
+        || (node.output != NoOutput && node.output >= header.entryCount)) {
+      return corrupt();
+    }
+    if (i != 0 && (_nodes[node.fail].depth >= node.depth
+                   || _nodes[node.dict].depth >= node.depth
+                   || (node.dict && _nodes[node.dict].output == NoOutput))) {
+      return corrupt();
+    }
+    for (uint32_t e = 0; e < node.edgeCount; ++e) {
+      auto target = _edges[node.edgeBegin + e].target;
+      if (target == 0 || target >= nodeCount
+          || _nodes[target].depth != node.depth + 1) {
+        return corrupt();
+      }
+    }
+  }
+  return true;
+}
+
+bool Lexicon::writeCache(const std::filesystem::path &path,
+                         uint64_t sourceSize, int64_t sourceTime) const
+{
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out.good()) {
+    return false;
+  }
+
+  CacheHeader header;
+  memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+  header.sourceSize = sourceSize;
+  header.sourceTime = sourceTime;
+  header.nodeCount = static_cast<uint32_t>(_nodes.size());
+  header.edgeCount = static_cast<uint32_t>(_edges.size());
+  header.entryCount = static_cast<uint32_t>(size());
+  header.replacementLength = static_cast<uint32_t>(_replacements.size());
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  writeVector(out, _nodes);
+  writeVector(out, _edges);
+  writeVector(out, _offsets);
+  writeVector(out, _boundaries);
+  out.write(reinterpret_cast<const char *>(_replacements.data()),
+            _replacements.size() * sizeof(wchar_t));
+  return out.good();
+}
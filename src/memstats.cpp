@@ -0,0 +1,259 @@
+#include "sam/memstats.h"
+
+#ifdef SAM_MEMSTATS
+
+#include "sam/sam.h"
+
+#include <psapi.h>
+#include <malloc.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+namespace {
+
+std::atomic<size_t> g_allocs{0};
+std::atomic<size_t> g_bytes{0};
+std::atomic<size_t> g_live{0};
+std::atomic<size_t> g_peak{0};
+// Highest working set sampled since the innermost open mark.
+std::atomic<size_t> g_peakRss{0};
+
+// Nothing below may allocate from the heap, or it would count itself.
+constexpr size_t MaxStages = 32;
+
+struct StageTotals {
+  const char *name;
+  size_t calls;
+  MemStats::Counters counters;
+};
+
+struct StageTable {
+  StageTotals stages[MaxStages];
+  size_t count;
+
+  void clear() {
+    count = 0;
+  }
+
+  void add(const char *name, const MemStats::Counters &c) {
+    StageTotals *s = nullptr;
+    for (size_t i = 0; i < count; ++i) {
+      if (stages[i].name == name || !strcmp(stages[i].name, name)) {
+        s = &stages[i];
+        break;
+      }
+    }
+    if (!s) {
+      if (count == MaxStages) {
+        return;
+      }
+      s = &stages[count++];
+      s->name = name;
+      s->calls = 0;
+      s->counters = MemStats::Counters{};
+    }
+    ++s->calls;
+    s->counters.allocs += c.allocs;
+    s->counters.bytes += c.bytes;
+    if (c.peakBytes > s->counters.peakBytes) {
+      s->counters.peakBytes = c.peakBytes;
+    }
+    if (c.peakRss > s->counters.peakRss) {
+      s->counters.peakRss = c.peakRss;
+    }
+  }
+};
+
+StageTable g_runStages;
+StageTable g_utteranceStages;
+bool g_inUtterance = false;
+size_t g_utteranceCount = 0;
+size_t g_byteBudget = 0;
+size_t g_allocBudget = 0;
+bool g_overBudget = false;
+
+void *countedAlloc(size_t size) noexcept {
+  void *p = malloc(size ? size : 1);
+  if (!p) {
+    return nullptr;
+  }
+  size = _msize(p);
+  ++g_allocs;
+  g_bytes += size;
+  auto live = g_live += size;
+  auto peak = g_peak.load(std::memory_order_relaxed);
+  while (live > peak && !g_peak.compare_exchange_weak(peak, live)) {
+  }
+  return p;
+}
+
+void countedFree(void *p) noexcept {
+  if (!p) {
+    return;
+  }
+  g_live -= _msize(p);
+  free(p);
+}
+
+PROCESS_MEMORY_COUNTERS memoryCounters() noexcept {
+  PROCESS_MEMORY_COUNTERS pmc{};
+  GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc));
+  return pmc;
+}
+
+size_t sampleRss() noexcept {
+  auto rss = memoryCounters().WorkingSetSize;
+  auto peak = g_peakRss.load(std::memory_order_relaxed);
+  while (rss > peak && !g_peakRss.compare_exchange_weak(peak, rss)) {
+  }
+  return rss;
+}
+
+MemStats::Mark begin() noexcept {
+  MemStats::Mark mark;
+  mark.allocs = g_allocs;
+  mark.bytes = g_bytes;
+  mark.live = g_live;
+  mark.savedPeak = g_peak.exchange(mark.live);
+  mark.rss = sampleRss();
+  mark.savedPeakRss = g_peakRss.exchange(mark.rss);
+  return mark;
+}
+
+MemStats::Counters end(const MemStats::Mark &mark) noexcept {
+  MemStats::Counters c;
+  auto peak = g_peak.load();
+  sampleRss();
+  auto peakRss = g_peakRss.load();
+  c.allocs = g_allocs - mark.allocs;
+  c.bytes = g_bytes - mark.bytes;
+  c.peakBytes = peak > mark.live ? peak - mark.live : 0;
+  c.peakRss = peakRss > mark.rss ? peakRss - mark.rss : 0;
+  if (mark.savedPeak > peak) {
+    g_peak = mark.savedPeak;
+  }
+  if (mark.savedPeakRss > peakRss) {
+    g_peakRss = mark.savedPeakRss;
+  }
+  return c;
+}
+
+void logStages(const StageTable &table) {
+  for (size_t i = 0; i < table.count; ++i) {
+    auto &s = table.stages[i];
+    Log::info("  {:<10} calls={} allocs={} bytes={} peak={} peak RSS=+{} KiB",
+              s.name, s.calls, s.counters.allocs, s.counters.bytes,
+              s.counters.peakBytes, s.counters.peakRss / 1024);
+  }
+}
+
+} // anonymous namespace
+
+namespace MemStats {
+
+Stage::Stage(const char *name) noexcept
+  : _name{name}, _mark{begin()}
+{}
+
+Stage::~Stage() {
+  auto c = end(_mark);
+  g_runStages.add(_name, c);
+  if (g_inUtterance) {
+    g_utteranceStages.add(_name, c);
+  }
+}
+
+Utterance::Utterance() noexcept {
+  g_utteranceStages.clear();
+  g_inUtterance = true;
+  _mark = begin();
+}
+
+Utterance::~Utterance() {
+  auto c = end(_mark);
+  g_inUtterance = false;
+  auto index = ++g_utteranceCount;
+
+  Log::info("Utterance {}: allocs={} bytes={} peak={} peak RSS=+{} KiB", index,
+            c.allocs, c.bytes, c.peakBytes, c.peakRss / 1024);
+  logStages(g_utteranceStages);
+  if (g_byteBudget && c.bytes > g_byteBudget) {
+    Log::error("Utterance {} allocated {} bytes, over the budget of {}.",
+               index, c.bytes, g_byteBudget);
+    g_overBudget = true;
+  }
+  if (g_allocBudget && c.allocs > g_allocBudget) {
+    Log::error("Utterance {} made {} allocations, over the budget of {}.",
+               index, c.allocs, g_allocBudget);
+    g_overBudget = true;
+  }
+}
+
+void setBudget(size_t bytes, size_t allocs) {
+  g_byteBudget = bytes;
+  g_allocBudget = allocs;
+}
+
+bool overBudget() {
+  return g_overBudget;
+}
+
+void printSummary() {
+  Log::info("Heap summary: {} utterances, allocs={} bytes={} "
+            "process peak RSS={} KiB", g_utteranceCount, g_allocs.load(),
+            g_bytes.load(), memoryCounters().PeakWorkingSetSize / 1024);
+  logStages(g_runStages);
+}
+
+} // namespace MemStats
+
+void *operator new(size_t size) {
+  if (void *p = countedAlloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void *operator new[](size_t size) {
+  if (void *p = countedAlloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc{};
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  return countedAlloc(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept {
+  countedFree(p);
+}
+
+void operator delete[](void *p) noexcept {
+  countedFree(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  countedFree(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  countedFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  countedFree(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  countedFree(p);
+}
+
+#endif // SAM_MEMSTATS
@@ -0,0 +1,77 @@
+#include "sam/offsetmap.h"
+
+#include <algorithm>
+
+void OffsetMap::add(uint32_t output, uint32_t source) {
+  if (!_points.empty()) {
+    auto &last = _points.back();
+    source = std::max(source, last.source);
+    if (last.output >= output) {
+      last.source = source;
+      return;
+    }
+  }
+  _points.push_back({output, source});
+}
+
+void OffsetMap::append(const OffsetMap &other, uint32_t base) {
+  if (other.empty()) {
+    // Identity from the start of the appended text.
+    add(base, base);
+    return;
+  }
+  for (auto &point : other._points) {
+    add(point.output + base, point.source);
+  }
+}
+
+uint32_t OffsetMap::toSource(uint32_t output) const {
+  auto next = std::upper_bound(
+    _points.begin(), _points.end(), output,
+    [](uint32_t offset, const Point &p) { return offset < p.output; });
+  if (next == _points.begin()) {
+    return output;
+  }
+  auto &point = *(next - 1);
+  uint32_t source = point.source + (output - point.output);
+  // Inside a replacement that is longer than what it replaced.
+  if (next != _points.end()) {
+    source = std::min(source, next->source);
+  }
+  return source;
+}
+
+uint32_t OffsetMap::toOutput(uint32_t source) const {
+  auto next = std::upper_bound(
+    _points.begin(), _points.end(), source,
+    [](uint32_t offset, const Point &p) { return offset < p.source; });
+  if (next == _points.begin()) {
+    return source;
+  }
+  auto &point = *(next - 1);
+  uint32_t output = point.output + (source - point.source);
+  if (next != _points.end()) {
+    output = std::min(output, next->output);
+  }
+  return output;
+}
+
+OffsetMap OffsetMap::compose(const OffsetMap &outer, const OffsetMap &inner) {
+  // The result can only change slope where either map has a point.
+  std::vector<uint32_t> outputs;
+  outputs.reserve(outer._points.size() + inner._points.size());
+  for (auto &point : outer._points) {
+    outputs.push_back(point.output);
+  }
+  for (auto &point : inner._points) {
+    outputs.push_back(outer.toOutput(point.output));
+  }
+  std::sort(outputs.begin(), outputs.end());
+  outputs.erase(std::unique(outputs.begin(), outputs.end()), outputs.end());
+
+  OffsetMap result;
+  for (auto output : outputs) {
+    result.add(output, inner.toSource(outer.toSource(output)));
+  }
+  return result;
+}
@@ -0,0 +1,449 @@
+#include "sam/pack.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace Pack {
+
+namespace {
+
+const uint32_t BlockMagic = 0x4B415053; // "SPAK"
+// Version 1 had no format in its index entries. Its records are the same,
+// so it can still be read by scanning.
+const char TrailerMagic[8] = {'S', 'A', 'M', 'P', 'A', 'C', 'K', '2'};
+
+const uint64_t RecordPrefix = sizeof(BlockHeader) + sizeof(RecordHeader);
+
+uint64_t alignBlock(uint64_t size) {
+  return (size + BlockAlign - 1) & ~(BlockAlign - 1);
+}
+
+template<typename T>
+T readAt(const uint8_t *base, uint64_t offset) {
+  T value;
+  memcpy(&value, base + offset, sizeof(T));
+  return value;
+}
+
+template<typename T>
+void append(std::vector<uint8_t> &block, const T &value) {
+  auto bytes = reinterpret_cast<const uint8_t *>(&value);
+  block.insert(block.end(), bytes, bytes + sizeof(T));
+}
+
+IndexEntry makeEntry(uint64_t hash, uint64_t offset,
+                     const RecordHeader &record) {
+  IndexEntry entry;
+  entry.keyHash = hash;
+  entry.recordOffset = offset;
+  entry.dataLength = record.dataLength;
+  entry.durationMs = record.durationMs;
+  entry.sampleRate = record.sampleRate;
+  entry.byteRate = record.byteRate;
+  entry.formatTag = record.formatTag;
+  entry.channels = record.channels;
+  entry.blockAlign = record.blockAlign;
+  entry.bitsPerSample = record.bitsPerSample;
+  return entry;
+}
+
+bool byHash(const IndexEntry &a, const IndexEntry &b) {
+  return a.keyHash != b.keyHash ? a.keyHash < b.keyHash
+                                : a.recordOffset < b.recordOffset;
+}
+
+} // anonymous namespace
+
+uint64_t hashKey(std::wstring_view key) {
+  // FNV-1a over the UTF-16 code units.
+  uint64_t hash = 0xCBF29CE484222325ull;
+  for (auto ch : key) {
+    hash = (hash ^ (ch & 0xFF)) * 0x100000001B3ull;
+    hash = (hash ^ ((ch >> 8) & 0xFF)) * 0x100000001B3ull;
+  }
+  return hash;
+}
+
+Reader::~Reader() {
+  close();
+}
+
+bool Reader::open(const std::filesystem::path &path) {
+  close();
+
+  _file = CreateFileW(path.c_str(), GENERIC_READ,
+                      FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (_file == INVALID_HANDLE_VALUE) {
+    Log::error(L"Couldn't open pack {}.", path.wstring());
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(_file, &size)) {
+    Log::error(L"Couldn't get the size of pack {}.", path.wstring());
+    close();
+    return false;
+  }
+  _length = static_cast<uint64_t>(size.QuadPart);
+  if (_length == 0) {
+    return true;
+  }
+  if (_length > SIZE_MAX) {
+    Log::error(L"Pack {} is too large to map.", path.wstring());
+    close();
+    return false;
+  }
+
+  _mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  if (_mapping) {
+    _base = static_cast<const uint8_t *>(
+      MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+  }
+  if (!_base) {
+    Log::error(L"Couldn't map pack {}: error 0x{:X}.", path.wstring(),
+               GetLastError());
+    close();
+    return false;
+  }
+
+  if (!readFooter()) {
+    Log::debug(L"Pack {} has no index; scanning records.", path.wstring());
+    scan();
+    if (_validLength < _length && _tornTail) {
+      Log::warn(L"Pack {} has {} bytes of incomplete data at the end.",
+                path.wstring(), _length - _validLength);
+    } else if (_validLength < _length) {
+      Log::warn(L"Pack {} has unreadable data at offset {}.", path.wstring(),
+                _validLength);
+    }
+  }
+  return true;
+}
+
+void Reader::close() {
+  if (_base) {
+    UnmapViewOfFile(_base);
+    _base = nullptr;
+  }
+  if (_mapping) {
+    CloseHandle(_mapping);
+    _mapping = nullptr;
+  }
+  if (_file != INVALID_HANDLE_VALUE) {
+    CloseHandle(_file);
+    _file = INVALID_HANDLE_VALUE;
+  }
+  _length = 0;
+  _validLength = 0;
+  _hasFooter = false;
+  _tornTail = false;
+  _index = nullptr;
+  _count = 0;
+  _scanned.clear();
+}
+
+bool Reader::readFooter() {
+  if (_length < sizeof(BlockHeader) + sizeof(Trailer)) {
+    return false;
+  }
+  auto trailer = readAt<Trailer>(_base, _length - sizeof(Trailer));
+  if (memcmp(trailer.magic, TrailerMagic, sizeof(TrailerMagic))
+      || trailer.indexOffset > _length - sizeof(BlockHeader) - sizeof(Trailer)
+      || trailer.indexOffset % BlockAlign) {
+    return false;
+  }
+
+  auto header = readAt<BlockHeader>(_base, trailer.indexOffset);
+  auto entriesSize = _length - trailer.indexOffset
+                   - sizeof(BlockHeader) - sizeof(Trailer);
+  if (header.magic != BlockMagic || header.type != IndexBlock
+      || header.size != _length - trailer.indexOffset
+      || entriesSize % sizeof(IndexEntry)) {
+    return false;
+  }
+
+  _index = reinterpret_cast<const IndexEntry *>(
+    _base + trailer.indexOffset + sizeof(BlockHeader));
+  _count = static_cast<size_t>(entriesSize / sizeof(IndexEntry));
+  _validLength = _length;
+  _hasFooter = true;
+  return true;
+}
+
+void Reader::scan() {
+  // Keys point into the mapping, which outlives this.
+  std::map<std::wstring_view, IndexEntry> latest;
+  uint64_t offset = 0;
+  while (_length - offset >= sizeof(BlockHeader)) {
+    auto header = readAt<BlockHeader>(_base, offset);
+    if (header.magic != BlockMagic || header.size < sizeof(BlockHeader)
+        || header.size % BlockAlign || header.size > _length - offset) {
+      break;
+    }
+
+    if (header.type == RecordBlock) {
+      if (header.size < RecordPrefix) {
+        break;
+      }
+      auto record = readAt<RecordHeader>(_base, offset + sizeof(BlockHeader));
+      auto payload = uint64_t(record.keyLength) * sizeof(wchar_t)
+                   + record.dataLength;
+      if (RecordPrefix + payload > header.size) {
+        break;
+      }
+      std::wstring_view key{
+        reinterpret_cast<const wchar_t *>(_base + offset + RecordPrefix),
+        record.keyLength};
+      latest[key] = makeEntry(hashKey(key), offset, record);
+    }
+    offset += header.size;
+  }
+
+  _validLength = offset;
+  // An append that was cut short leaves a block header, or part of one,
+  // whose block runs past the end of the file.
+  auto rest = _length - offset;
+  if (rest && !memcmp(_base + offset, &BlockMagic,
+                      (std::min<uint64_t>)(rest, sizeof(BlockMagic)))) {
+    if (rest < sizeof(BlockHeader)) {
+      _tornTail = true;
+    } else {
+      auto header = readAt<BlockHeader>(_base, offset);
+      _tornTail = header.size > rest && header.size % BlockAlign == 0;
+    }
+  }
+
+  _scanned.reserve(latest.size());
+  for (auto &[key, entry] : latest) {
+    _scanned.push_back(entry);
+  }
+  std::sort(_scanned.begin(), _scanned.end(), byHash);
+  _index = _scanned.data();
+  _count = _scanned.size();
+}
+
+bool Reader::slice(const IndexEntry &entry, Slice &slice) const {
+  auto offset = entry.recordOffset;
+  if (offset > _validLength || _validLength - offset < RecordPrefix) {
+    return false;
+  }
+  auto header = readAt<BlockHeader>(_base, offset);
+  auto record = readAt<RecordHeader>(_base, offset + sizeof(BlockHeader));
+  auto keyBytes = uint64_t(record.keyLength) * sizeof(wchar_t);
+  if (header.magic != BlockMagic || header.type != RecordBlock
+      || header.size > _validLength - offset
+      || RecordPrefix + keyBytes + record.dataLength > header.size) {
+    return false;
+  }
+
+  slice.key = std::wstring_view{
+    reinterpret_cast<const wchar_t *>(_base + offset + RecordPrefix),
+    record.keyLength};
+  slice.format = WavInfo{};
+  slice.format.formatTag = record.formatTag;
+  slice.format.channels = record.channels;
+  slice.format.sampleRate = record.sampleRate;
+  slice.format.byteRate = record.byteRate;
+  slice.format.blockAlign = record.blockAlign;
+  slice.format.bitsPerSample = record.bitsPerSample;
+  slice.format.dataLength = record.dataLength;
+  slice.data = _base + offset + RecordPrefix + keyBytes;
+  return true;
+}
+
+bool Reader::find(std::wstring_view key, Slice &out) const {
+  auto hash = hashKey(key);
+  auto it = std::lower_bound(
+    begin(), end(), hash,
+    [](const IndexEntry &e, uint64_t h) { return e.keyHash < h; });
+  for (; it != end() && it->keyHash == hash; ++it) {
+    if (slice(*it, out) && out.key == key) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool Writer::open(const std::filesystem::path &path) {
+  close();
+  _entries.clear();
+  _offset = 0;
+  _indexed = false;
+
+  std::error_code ec;
+  if (std::filesystem::exists(path, ec)) {
+    Reader reader;
+    if (!reader.open(path)) {
+      return false;
+    }
+    for (auto &entry : reader) {
+      Slice slice;
+      if (reader.slice(entry, slice)) {
+        _entries[std::wstring{slice.key}] = entry;
+      }
+    }
+    _offset = reader.validLength();
+    _indexed = reader.hasFooter();
+
+    auto length = std::filesystem::file_size(path, ec);
+    if (ec) {
+      Log::error(L"Couldn't get the size of pack {}.", path.wstring());
+      return false;
+    }
+    if (length > _offset && !reader.tornTail()) {
+      if (_offset == 0) {
+        Log::error(L"{} is not a pack.", path.wstring());
+      } else {
+        Log::error(L"Pack {} is corrupt at offset {}; not appending to it.",
+                   path.wstring(), _offset);
+      }
+      return false;
+    }
+  }
+
+  _file = CreateFileW(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (_file == INVALID_HANDLE_VALUE) {
+    Log::error(L"Couldn't open pack {} for writing.", path.wstring());
+    return false;
+  }
+
+  // Drop the part of a block that a crashed writer left at the end.
+  LARGE_INTEGER offset;
+  offset.QuadPart = static_cast<LONGLONG>(_offset);
+  if (!SetFilePointerEx(_file, offset, nullptr, FILE_BEGIN)
+      || !SetEndOfFile(_file)) {
+    Log::error(L"Couldn't truncate pack {}: error 0x{:X}.", path.wstring(),
+               GetLastError());
+    CloseHandle(_file);
+    _file = INVALID_HANDLE_VALUE;
+    return false;
+  }
+  return true;
+}
+
+bool Writer::writeBlock(const std::vector<uint8_t> &block) {
+  const uint8_t *data = block.data();
+  size_t remaining = block.size();
+  bool ok = true;
+  while (ok && remaining) {
+    DWORD chunk = static_cast<DWORD>(std::min<size_t>(remaining, 1 << 30));
+    DWORD written = 0;
+    ok = WriteFile(_file, data, chunk, &written, nullptr) && written;
+    data += written;
+    remaining -= written;
+  }
+  // The block isn't committed until it's on disk; otherwise a power loss
+  // could leave a later index pointing at data that never made it.
+  if (ok && FlushFileBuffers(_file)) {
+    return true;
+  }
+
+  Log::error("Failed writing to pack: error 0x{:X}.", GetLastError());
+  // Take back whatever part of the block made it, so the next one starts
+  // where the index expects.
+  LARGE_INTEGER offset;
+  offset.QuadPart = static_cast<LONGLONG>(_offset);
+  SetFilePointerEx(_file, offset, nullptr, FILE_BEGIN);
+  SetEndOfFile(_file);
+  return false;
+}
+
+bool Writer::add(std::wstring_view key, const WavInfo &format,
+                 const uint8_t *data, uint32_t length)
+{
+  if (_file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  auto keyBytes = uint64_t(key.length()) * sizeof(wchar_t);
+  BlockHeader header{BlockMagic, RecordBlock,
+                     alignBlock(RecordPrefix + keyBytes + length)};
+  RecordHeader record;
+  record.keyLength = static_cast<uint32_t>(key.length());
+  record.dataLength = length;
+  record.durationMs = format.byteRate
+                    ? uint32_t(uint64_t(length) * 1000 / format.byteRate) : 0;
+  record.sampleRate = format.sampleRate;
+  record.byteRate = format.byteRate;
+  record.formatTag = format.formatTag;
+  record.channels = format.channels;
+  record.blockAlign = format.blockAlign;
+  record.bitsPerSample = format.bitsPerSample;
+
+  _block.clear();
+  _block.reserve(header.size);
+  append(_block, header);
+  append(_block, record);
+  auto keyData = reinterpret_cast<const uint8_t *>(key.data());
+  _block.insert(_block.end(), keyData, keyData + keyBytes);
+  _block.insert(_block.end(), data, data + length);
+  _block.resize(header.size, 0);
+  if (!writeBlock(_block)) {
+    return false;
+  }
+
+  _entries[std::wstring{key}] = makeEntry(hashKey(key), _offset, record);
+  _offset += header.size;
+  _indexed = false;
+  return true;
+}
+
+bool Writer::add(std::wstring_view key, const std::filesystem::path &wavPath) {
+  WavInfo info;
+  if (!readWavInfo(wavPath, info)) {
+    return false;
+  }
+  std::ifstream in(wavPath, std::ios::binary);
+  std::vector<uint8_t> data(info.dataLength);
+  in.seekg(info.dataOffset, std::ios::beg);
+  if (!in.read(reinterpret_cast<char *>(data.data()), data.size())) {
+    Log::error(L"Couldn't read {}.", wavPath.wstring());
+    return false;
+  }
+  return add(key, info, data.data(), info.dataLength);
+}
+
+bool Writer::close() {
+  if (_file == INVALID_HANDLE_VALUE) {
+    return true;
+  }
+
+  bool ok = true;
+  if (!_indexed) {
+    std::vector<IndexEntry> entries;
+    entries.reserve(_entries.size());
+    for (auto &[key, entry] : _entries) {
+      entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), byHash);
+
+    BlockHeader header{BlockMagic, IndexBlock,
+                       sizeof(BlockHeader)
+                       + entries.size() * sizeof(IndexEntry)
+                       + sizeof(Trailer)};
+    Trailer trailer;
+    trailer.indexOffset = _offset;
+    memcpy(trailer.magic, TrailerMagic, sizeof(TrailerMagic));
+
+    _block.clear();
+    append(_block, header);
+    for (auto &entry : entries) {
+      append(_block, entry);
+    }
+    append(_block, trailer);
+    if (writeBlock(_block)) {
+      _offset += header.size;
+      _indexed = true;
+    } else {
+      ok = false;
+    }
+  }
+
+  CloseHandle(_file);
+  _file = INVALID_HANDLE_VALUE;
+  return ok;
+}
+
+} // namespace Pack
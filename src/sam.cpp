@@ -1,4 +1,9 @@
 #include "sam/tts.h"
+#include "sam/lexicon.h"
+#include "sam/memstats.h"
+#include "sam/pack.h"
+#include "sam/seekindex.h"
+#include "sam/voicepool.h"
 
 #include <spdlog/sinks/stdout_color_sinks.h>
 
@@ -62,12 +67,19 @@ struct CommandLine {
   bool listVoices = false;
   bool showVoiceInfo = false;
   bool inputFromStdin = false;
+  bool writeIndex = false;
+  long seekOffset = -1;
+  int poolSize = 4;
   std::wstring voiceName = L"Sam";
   int pitch = 0;
   int speed = 0;
   std::wstring text;
   std::wstring outputFilename;
+  std::wstring lexiconFilename;
+  std::wstring packFilename;
   int logLevel = -1;
+  size_t byteBudget = 0;
+  size_t allocBudget = 0;
 };
 
 static void showHelp() {
@@ -78,12 +90,27 @@ static void showHelp() {
     "-h         Show help.\n"
     "-l         List voices.\n"
     "-i         Show information for the selected voice.\n"
-    "-v <name>  Select voice.\n"
+    "-v <name>  Select voice. The text can switch voices with inline markers like\n"
+    "           [[voice=Mary; pitch=120; speed=150]], or [[]] to reset. From stdin,\n"
+    "           settings carry over to the following lines.\n"
+    "-c <num>   Keep up to <num> voices initialized at once (default 4).\n"
     "-p <num>   Set voice pitch.\n"
     "-s <num>   Set voice speed.\n"
     "-f <file>  Set an input file to read.\n"
     "-o <file>  Write output to a file instead of playing directly.\n"
+    "-I         With -o, also write a seek index to <file>.idx mapping sentence,\n"
+    "           paragraph and chapter starts in the input text to byte offsets.\n"
+    "-k <num>   With -o, print the byte range in <file> for a text offset using\n"
+    "           its seek index, then exit.\n"
+    "-P <file>  Append each utterance to a pack file instead of playing directly.\n"
+    "           With input from stdin, a line of the form <id><TAB><text> is stored\n"
+    "           under <id>; otherwise the key is a hash of the text.\n"
+    "-x <file>  Rewrite text using a pronunciation lexicon of 'pattern = replacement'\n"
+    "           lines.\n"
     "-V <level> Set logger level to: trace, debug, info, warn, error, critical, off.\n"
+    "-M <bytes> Fail if an utterance allocates more than this many heap bytes.\n"
+    "-A <num>   Fail if an utterance makes more than this many heap allocations.\n"
+    "           -M and -A require a build with SAM_MEMSTATS enabled.\n"
   );
 }
 
@@ -179,6 +206,49 @@ static bool parseArgs(int argc, wchar_t *argv[], CommandLine &commandLine) {
           return false;
         }
         break;
+      case 'c':
+        if (len > 2) {
+          commandLine.poolSize = wcstol(argv[i] + 2, nullptr, 10);
+        } else if (++i < argc) {
+          commandLine.poolSize = wcstol(argv[i], nullptr, 10);
+        } else {
+          Log::error("Command line: -c without voice count.");
+          return false;
+        }
+        break;
+      case 'I':
+        commandLine.writeIndex = true;
+        break;
+      case 'k':
+        if (len > 2) {
+          commandLine.seekOffset = wcstol(argv[i] + 2, nullptr, 10);
+        } else if (++i < argc) {
+          commandLine.seekOffset = wcstol(argv[i], nullptr, 10);
+        } else {
+          Log::error("Command line: -k without text offset.");
+          return false;
+        }
+        break;
+      case 'P':
+        if (len > 2) {
+          commandLine.packFilename = arg.substr(2);
+        } else if (++i < argc) {
+          commandLine.packFilename = argv[i];
+        } else {
+          Log::error("Command line: -P without filename.");
+          return false;
+        }
+        break;
+      case 'x':
+        if (len > 2) {
+          commandLine.lexiconFilename = arg.substr(2);
+        } else if (++i < argc) {
+          commandLine.lexiconFilename = argv[i];
+        } else {
+          Log::error("Command line: -x without filename.");
+          return false;
+        }
+        break;
       case 'V':
         {
           std::wstring_view level;
@@ -212,6 +282,26 @@ static bool parseArgs(int argc, wchar_t *argv[], CommandLine &commandLine) {
           }
         }
         break;
+      case 'M':
+        if (len > 2) {
+          commandLine.byteBudget = wcstoul(argv[i] + 2, nullptr, 10);
+        } else if (++i < argc) {
+          commandLine.byteBudget = wcstoul(argv[i], nullptr, 10);
+        } else {
+          Log::error("Command line: -M without byte count.");
+          return false;
+        }
+        break;
+      case 'A':
+        if (len > 2) {
+          commandLine.allocBudget = wcstoul(argv[i] + 2, nullptr, 10);
+        } else if (++i < argc) {
+          commandLine.allocBudget = wcstoul(argv[i], nullptr, 10);
+        } else {
+          Log::error("Command line: -A without allocation count.");
+          return false;
+        }
+        break;
       case '-':
         if (arg[0] == '-' && arg.length() == 2) {
           parseOptions = false;
@@ -237,6 +327,174 @@ break_arg_loop:
   return true;
 }
 
+static int seekIndexLookup(const CommandLine &commandLine) {
+  if (commandLine.outputFilename.empty()) {
+    Log::error("Command line: -k requires -o.");
+    return 1;
+  }
+
+  SeekIndex index;
+  if (!index.load(SeekIndex::pathFor(commandLine.outputFilename))) {
+    return 1;
+  }
+  SeekIndex::Range range;
+  if (!index.lookup((uint32_t)commandLine.seekOffset, range)) {
+    Log::error("Seek index is empty.");
+    return 1;
+  }
+  fmt::print("{} {}\n", range.begin, range.end);
+  return 0;
+}
+
+static bool isBlank(std::wstring_view text) {
+  return std::all_of(text.begin(), text.end(), iswspace);
+}
+
+// Removes a file when it goes out of scope.
+struct ScopedRemove {
+  std::filesystem::path path;
+
+  ~ScopedRemove() {
+    if (!path.empty()) {
+      std::error_code ec;
+      std::filesystem::remove(path, ec);
+    }
+  }
+};
+
+// Splits a leading manifest ID off of \p text, or hashes \p text if there
+// isn't one.
+static std::wstring packKey(std::wstring_view &text, bool allowId) {
+  if (allowId) {
+    auto tab = text.find(L'\t');
+    if (tab != std::wstring_view::npos && tab > 0) {
+      std::wstring id{text.substr(0, tab)};
+      text.remove_prefix(tab + 1);
+      return id;
+    }
+  }
+  return fmt::format(L"{:016x}", Pack::hashKey(text));
+}
+
+// Removes the previous utterance's render so that a failed render can't be
+// packed under the next key.
+static bool clearPackTemp(const std::wstring &path) {
+  std::error_code ec;
+  if (!std::filesystem::remove(path, ec) && ec) {
+    Log::error(L"Couldn't remove {}.", path);
+    return false;
+  }
+  return true;
+}
+
+// Speak one document, switching voices at inline markers. With file output,
+// a document with several segments is rendered piecewise by each voice's
+// engine and then stitched together in order. \p voice holds the settings
+// left by the previous document's markers and is updated for the next one.
+// \p rendered is set if any audio was produced, which it isn't for a
+// document of nothing but markers.
+static bool speak(std::wstring_view text, const CommandLine &commandLine,
+                  const Lexicon &lexicon, VoicePool &pool, NotifySink &sink,
+                  VoiceSettings &voice, bool &rendered)
+{
+  rendered = false;
+  const VoiceSettings defaults{commandLine.voiceName, commandLine.pitch,
+                               commandLine.speed};
+  auto segments = splitVoiceSegments(text, defaults, voice);
+  const bool assemble = pool.isFileOutput() && segments.size() > 1;
+  const bool writeIndex = commandLine.writeIndex;
+
+  WavWriter writer;
+  std::wstring spoken;
+  // Maps offsets in spoken back to text, from which the markers have been
+  // removed and which the lexicon has rewritten.
+  OffsetMap sourceOffsets;
+  std::vector<BufNotifySink::WordTiming> timings;
+  for (auto &segment : segments) {
+    auto textOffset = static_cast<DWORD>(spoken.length());
+    if (writeIndex) {
+      OffsetMap lexiconOffsets;
+      lexicon.apply(segment.text, &lexiconOffsets);
+      sourceOffsets.append(
+        OffsetMap::compose(lexiconOffsets, segment.sourceOffsets),
+        textOffset);
+    } else {
+      lexicon.apply(segment.text);
+    }
+    spoken += segment.text;
+    if (isBlank(segment.text)) {
+      continue;
+    }
+
+    auto engine = pool.acquire(segment.voice);
+    if (!engine) {
+      return false;
+    }
+    auto &tts = engine->tts;
+    if (pool.isFileOutput()) {
+      tts.setOutputFilename(assemble ? engine->partFilename
+                                     : pool.outputFilename());
+    }
+
+    // The engine holds a reference to the buffer sink for as long as it
+    // likes, so it lives on the heap and goes away with its last Release.
+    auto bufSink = writeIndex ? new BufNotifySink : nullptr;
+    tts.say(segment.text, sink, (WORD)segment.pitch, (DWORD)segment.speed,
+            bufSink);
+    sink.wait();
+    std::vector<BufNotifySink::WordTiming> words;
+    if (bufSink) {
+      words = bufSink->wordTimings();
+      bufSink->Release();
+    }
+    rendered = true;
+
+    QWORD audioBase = writer.dataLength();
+    if (assemble) {
+      WavInfo part;
+      if (!readWavInfo(engine->partFilename, part)) {
+        return false;
+      }
+      if (!writer.isOpen()) {
+        if (!writer.open(pool.outputFilename(), part)) {
+          return false;
+        }
+      } else if (!sameWavFormat(writer.format(), part)) {
+        Log::error(L"Voice {} renders in a different audio format; "
+                   L"can't join it to the output.", segment.voice);
+        return false;
+      }
+      if (!writer.append(engine->partFilename, part)) {
+        return false;
+      }
+    }
+
+    // Rebase word timing onto the joined text and audio.
+    auto start = sink.audioStartTime();
+    for (auto &word : words) {
+      timings.push_back({
+        word.byteOffset + textOffset * DWORD(sizeof(wchar_t)),
+        (word.timeStamp > start ? word.timeStamp - start : 0) + audioBase,
+      });
+    }
+  }
+  if (!writer.close()) {
+    Log::error(L"Couldn't write {}.", pool.outputFilename());
+    return false;
+  }
+
+  if (writeIndex) {
+    WavInfo wav;
+    if (!readWavInfo(pool.outputFilename(), wav)) {
+      return false;
+    }
+    SeekIndex index;
+    index.build(spoken, timings, 0, wav, sourceOffsets);
+    index.write(SeekIndex::pathFor(pool.outputFilename()));
+  }
+  return true;
+}
+
 int wmain(int argc, wchar_t *argv[]) {
   ScopedSpdlog _scopedSpdlog;
   Log::g_logger->set_level(
@@ -251,8 +509,14 @@ int wmain(int argc, wchar_t *argv[]) {
                  ENABLE_PROCESSED_OUTPUT | ENABLE_WRAP_AT_EOL_OUTPUT
                  | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
   CommandLine commandLine;
-  if (!parseArgs(argc, argv, commandLine)) {
-    return 1;
+  {
+    MemStats::Stage stage{"args"};
+    if (!parseArgs(argc, argv, commandLine)) {
+      return 1;
+    }
+  }
+  if (commandLine.seekOffset > -1) {
+    return seekIndexLookup(commandLine);
   }
   if (commandLine.text.empty()) {
     commandLine.inputFromStdin = true;
@@ -267,31 +531,62 @@ int wmain(int argc, wchar_t *argv[]) {
     return 0;
   }
 
+  if (!commandLine.packFilename.empty()) {
+    if (!commandLine.outputFilename.empty()) {
+      Log::warn("-o is ignored with -P.");
+    }
+    if (commandLine.writeIndex) {
+      Log::warn("-I is not supported with -P; not writing a seek index.");
+      commandLine.writeIndex = false;
+    }
+    // Utterances are rendered here and then copied into the pack.
+    commandLine.outputFilename = commandLine.packFilename + L".tmp.wav";
+  }
+
+  if (commandLine.writeIndex
+      && (commandLine.outputFilename.empty() || commandLine.inputFromStdin)) {
+    Log::warn("-I needs -o and text from the command line or -f; "
+              "not writing a seek index.");
+    commandLine.writeIndex = false;
+  }
+
+  if (commandLine.byteBudget || commandLine.allocBudget) {
+    if (!MemStats::enabled) {
+      Log::warn("-M and -A have no effect: built without SAM_MEMSTATS.");
+    }
+    MemStats::setBudget(commandLine.byteBudget, commandLine.allocBudget);
+  }
+
   RAIIOLEInit oleInit;
   if (!oleInit) {
     Log::critical("Couldn't initialize OLE!");
     return GetLastError();
   }
 
-  TTSContainer tts;
   HRESULT hr;
   if (commandLine.listVoices) {
-    if (FAILED(hr = tts.listVoices())) {
+    MemStats::Stage stage{"enumerate"};
+    if (FAILED(hr = TTSContainer{}.listVoices())) {
       Log::critical("TTS enumeration failed.");
       return hr;
     }
     return 0;
   }
 
-  hr = tts.init(commandLine.voiceName, commandLine.outputFilename);
-  if (FAILED(hr)) {
+  // Declared before the pool so the file is removed after its engines let go.
+  ScopedRemove packTemp;
+
+  VoicePool pool{(size_t)(std::max)(commandLine.poolSize, 1),
+                 commandLine.outputFilename};
+  auto engine = pool.acquire(commandLine.voiceName);
+  if (!engine) {
     Log::critical("Couldn't initialize TTS!");
-    return hr;
+    return 1;
   }
 
   if (commandLine.showVoiceInfo) {
-    auto [minPitch, maxPitch, defPitch] = tts.pitchInfo();
-    auto [minSpeed, maxSpeed, defSpeed] = tts.speedInfo();
+    auto [minPitch, maxPitch, defPitch] = engine->tts.pitchInfo();
+    auto [minSpeed, maxSpeed, defSpeed] = engine->tts.speedInfo();
     Log::info("Pitch: min={}; max={}; default={}.", minPitch, maxPitch,
               defPitch);
     Log::info("Speed: min={}; max={}; default={}.", minSpeed, maxSpeed,
@@ -299,7 +594,26 @@ int wmain(int argc, wchar_t *argv[]) {
     return 0;
   }
 
+  Lexicon lexicon;
+  if (!commandLine.lexiconFilename.empty()) {
+    MemStats::Stage stage{"lexload"};
+    if (!lexicon.load(commandLine.lexiconFilename)) {
+      return 1;
+    }
+  }
+
+  const bool isPack = !commandLine.packFilename.empty();
+  Pack::Writer packWriter;
+  if (isPack) {
+    if (!packWriter.open(commandLine.packFilename)) {
+      return 1;
+    }
+    packTemp.path = commandLine.outputFilename;
+  }
+
   NotifySink sink;
+  VoiceSettings voice{commandLine.voiceName, commandLine.pitch,
+                      commandLine.speed};
   if (commandLine.inputFromStdin) {
     Log::info("Interactive mode. Ctrl-Z to end.");
     SetConsoleCtrlHandler(nullptr, false);
@@ -307,18 +621,60 @@ int wmain(int argc, wchar_t *argv[]) {
     while (std::wcin.good()) {
       line.clear();
       std::getline(std::wcin, line);
-      if (std::all_of(line.cbegin(), line.cend(), iswspace)) {
+      if (isBlank(line)) {
         continue;
       }
-      tts.say(line, sink, (WORD)commandLine.pitch,
-              (DWORD)commandLine.speed);
-      sink.wait();
+      MemStats::Utterance utterance;
+      std::wstring_view text = line;
+      std::wstring key;
+      if (isPack) {
+        key = packKey(text, true);
+        if (!clearPackTemp(commandLine.outputFilename)) {
+          continue;
+        }
+      }
+      bool rendered;
+      if (!speak(text, commandLine, lexicon, pool, sink, voice, rendered)
+          || !isPack) {
+        continue;
+      }
+      if (!rendered) {
+        Log::warn(L"Nothing to say for '{}'; not adding it to the pack.", key);
+        continue;
+      }
+      MemStats::Stage stage{"pack"};
+      if (!packWriter.add(key, commandLine.outputFilename)) {
+        Log::error(L"Couldn't add '{}' to the pack.", key);
+      }
     }
   } else {
-    tts.say(commandLine.text, sink, (WORD)commandLine.pitch,
-            (DWORD)commandLine.speed);
-    sink.wait();
+    MemStats::Utterance utterance;
+    if (isPack && !clearPackTemp(commandLine.outputFilename)) {
+      return 1;
+    }
+    bool rendered;
+    if (!speak(commandLine.text, commandLine, lexicon, pool, sink, voice,
+               rendered)) {
+      return 1;
+    }
+    if (isPack) {
+      if (!rendered) {
+        Log::error("Nothing to say; not adding it to the pack.");
+        return 1;
+      }
+      MemStats::Stage stage{"pack"};
+      std::wstring_view text = commandLine.text;
+      if (!packWriter.add(packKey(text, false), commandLine.outputFilename)) {
+        return 1;
+      }
+    }
   }
 
-  return 0;
+  if (!packWriter.close()) {
+    return 1;
+  }
+
+  pool.logStats();
+  MemStats::printSummary();
+  return MemStats::overBudget() ? 2 : 0;
 }
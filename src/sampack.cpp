@@ -0,0 +1,157 @@
+#include "sam/pack.h"
+
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+namespace Log {
+  std::shared_ptr<spdlog::logger> g_logger;
+}
+
+struct ScopedSpdlog {
+  explicit ScopedSpdlog() noexcept {
+    Log::g_logger = spdlog::stderr_color_mt("sampack");
+    spdlog::set_pattern("%^%l:%$ %v");
+  }
+
+  ~ScopedSpdlog() {
+    spdlog::drop_all();
+  }
+};
+
+static void showHelp() {
+  fmt::print("{}",
+    "sampack - Manage packs of utterances rendered by sam -P.\n"
+    "Usage:\n"
+    "sampack list <pack>                   List keys, durations and formats.\n"
+    "sampack extract <pack> <key> [file]   Write one utterance to a WAV file,\n"
+    "                                      <key>.wav by default.\n"
+    "sampack compact <pack>                Drop replaced records and stale indexes.\n"
+  );
+}
+
+static int list(const std::filesystem::path &path) {
+  Pack::Reader reader;
+  if (!reader.open(path)) {
+    return 1;
+  }
+
+  uint64_t totalMs = 0;
+  for (auto &entry : reader) {
+    Pack::Slice slice;
+    if (!reader.slice(entry, slice)) {
+      Log::warn("Bad record at offset {}.", entry.recordOffset);
+      continue;
+    }
+    std::wcout << slice.key << L'\t'
+               << entry.durationMs / 1000 << L'.'
+               << std::setw(3) << std::setfill(L'0') << entry.durationMs % 1000
+               << L"s\t" << entry.dataLength << L" bytes\t"
+               << entry.sampleRate << L" Hz "
+               << entry.bitsPerSample << L"-bit "
+               << entry.channels << L"ch\n";
+    totalMs += entry.durationMs;
+  }
+  Log::info("{} utterances, {:.1f}s of audio, {}.", reader.size(),
+            totalMs / 1000.0,
+            reader.hasFooter() ? "indexed" : "not indexed");
+  return 0;
+}
+
+static int extract(const std::filesystem::path &path, std::wstring_view key,
+                   std::filesystem::path output) {
+  Pack::Reader reader;
+  if (!reader.open(path)) {
+    return 1;
+  }
+
+  Pack::Slice slice;
+  if (!reader.find(key, slice)) {
+    Log::error(L"No utterance with key '{}'.", key);
+    return 1;
+  }
+
+  if (output.empty()) {
+    output = std::wstring{key} + L".wav";
+  }
+  WavWriter writer;
+  if (!writer.open(output, slice.format)
+      || !writer.write(slice.data, slice.format.dataLength)
+      || !writer.close()) {
+    Log::error(L"Couldn't write {}.", output.wstring());
+    return 1;
+  }
+  return 0;
+}
+
+static int compact(const std::filesystem::path &path) {
+  auto compacted = path;
+  compacted += L".compact";
+  std::error_code ec;
+  std::filesystem::remove(compacted, ec);
+
+  uint64_t before;
+  {
+    Pack::Reader reader;
+    if (!reader.open(path)) {
+      return 1;
+    }
+    before = std::filesystem::file_size(path, ec);
+
+    Pack::Writer writer;
+    if (!writer.open(compacted)) {
+      return 1;
+    }
+    // Keep records in file order so related utterances stay together.
+    std::vector<Pack::IndexEntry> entries(reader.begin(), reader.end());
+    std::sort(entries.begin(), entries.end(), [](auto &a, auto &b) {
+      return a.recordOffset < b.recordOffset;
+    });
+    for (auto &entry : entries) {
+      Pack::Slice slice;
+      if (!reader.slice(entry, slice)
+          || !writer.add(slice.key, slice.format, slice.data,
+                         slice.format.dataLength)) {
+        Log::error("Couldn't copy record at offset {}.", entry.recordOffset);
+        return 1;
+      }
+    }
+    if (!writer.close()) {
+      return 1;
+    }
+  }
+
+  if (!MoveFileExW(compacted.c_str(), path.c_str(),
+                   MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+    Log::error("Couldn't replace the pack: error 0x{:X}.", GetLastError());
+    return 1;
+  }
+  Log::info("Compacted from {} to {} bytes.", before,
+            std::filesystem::file_size(path, ec));
+  return 0;
+}
+
+int wmain(int argc, wchar_t *argv[]) {
+  ScopedSpdlog _scopedSpdlog;
+
+  if (argc < 3) {
+    showHelp();
+    return argc == 1 ? 0 : 1;
+  }
+
+  std::wstring_view command = argv[1];
+  std::filesystem::path path = argv[2];
+  if (command == L"list") {
+    return list(path);
+  } else if (command == L"extract" && argc >= 4) {
+    return extract(path, argv[3], argc >= 5 ? argv[4] : L"");
+  } else if (command == L"compact") {
+    return compact(path);
+  }
+
+  showHelp();
+  return 1;
+}
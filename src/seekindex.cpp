@@ -0,0 +1,237 @@
+#include "sam/seekindex.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cwctype>
+
+namespace {
+
+const char IndexMagic[8] = {'S', 'A', 'M', 'I', 'D', 'X', '1', 0};
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t count;
+  uint32_t dataOffset;
+  uint32_t dataLength;
+  uint32_t reserved;
+};
+
+struct Boundary {
+  uint32_t textOffset;
+  uint32_t kind;
+};
+
+bool isChapterHeading(std::wstring_view text) {
+  constexpr std::wstring_view chapter = L"chapter";
+  if (text.length() < chapter.length()) {
+    return false;
+  }
+  for (size_t i = 0; i < chapter.length(); ++i) {
+    if (towlower(text[i]) != chapter[i]) {
+      return false;
+    }
+  }
+  return text.length() == chapter.length()
+    || !iswalpha(text[chapter.length()]);
+}
+
+bool isClosingPunctuation(wchar_t ch) {
+  return ch == L'"' || ch == L'\'' || ch == L')' || ch == L']'
+    || ch == L'\x201D' || ch == L'\x2019' || ch == L'\xBB';
+}
+
+// A sentence starts after terminal punctuation and whitespace, a paragraph
+// after a blank line, and a chapter at a form feed or a line starting with
+// "Chapter".
+std::vector<Boundary> findBoundaries(std::wstring_view text) {
+  using K = SeekIndex::Kind;
+  std::vector<Boundary> boundaries;
+  uint32_t pending = K::Paragraph | K::Sentence;
+  bool lineStart = true;
+  bool terminal = false;
+  int newlines = 0;
+
+  for (size_t i = 0; i < text.length(); ++i) {
+    auto ch = text[i];
+    if (ch == L'\f') {
+      pending |= K::Chapter | K::Paragraph | K::Sentence;
+      lineStart = true;
+      continue;
+    }
+    if (iswspace(ch)) {
+      if (terminal) {
+        pending |= K::Sentence;
+        terminal = false;
+      }
+      if (ch == L'\n') {
+        lineStart = true;
+        if (++newlines >= 2) {
+          pending |= K::Paragraph | K::Sentence;
+        }
+      }
+      continue;
+    }
+
+    auto kind = pending;
+    if (lineStart && isChapterHeading(text.substr(i))) {
+      kind |= K::Chapter | K::Paragraph | K::Sentence;
+    }
+    if (kind) {
+      boundaries.push_back({static_cast<uint32_t>(i), kind});
+    }
+    pending = 0;
+    newlines = 0;
+    lineStart = false;
+
+    if (ch == L'.' || ch == L'!' || ch == L'?') {
+      terminal = true;
+    } else if (!terminal || !isClosingPunctuation(ch)) {
+      terminal = false;
+    }
+  }
+
+  return boundaries;
+}
+
+} // anonymous namespace
+
+void SeekIndex::build(std::wstring_view text,
+                      const std::vector<BufNotifySink::WordTiming> &words,
+                      QWORD startTime, const WavInfo &wav,
+                      const OffsetMap &sourceOffsets)
+{
+  _entries.clear();
+  _dataOffset = wav.dataOffset;
+  _dataLength = wav.dataLength;
+
+  auto sorted = words;
+  std::sort(sorted.begin(), sorted.end(),
+            [](auto &a, auto &b) { return a.byteOffset < b.byteOffset; });
+
+  auto blockAlign = wav.blockAlign ? wav.blockAlign : 1u;
+  uint32_t lastByte = 0;
+  for (auto &boundary : findBoundaries(text)) {
+    // The engine reports the first word it speaks at or after the boundary.
+    DWORD textBytes = boundary.textOffset * sizeof(wchar_t);
+    auto word = std::lower_bound(
+      sorted.begin(), sorted.end(), textBytes,
+      [](auto &w, DWORD offset) { return w.byteOffset < offset; });
+    if (word == sorted.end()) {
+      break;
+    }
+
+    QWORD elapsed = word->timeStamp > startTime
+                  ? word->timeStamp - startTime : 0;
+    auto byteOffset = static_cast<uint32_t>(
+      std::min<QWORD>(elapsed, _dataLength));
+    byteOffset -= byteOffset % blockAlign;
+    if (_entries.empty()) {
+      byteOffset = 0;
+    }
+    lastByte = (std::max)(lastByte, byteOffset);
+    auto textOffset = sourceOffsets.toSource(boundary.textOffset);
+    if (!_entries.empty() && _entries.back().textOffset == textOffset) {
+      // Boundaries inside the same replacement collapse onto one source
+      // offset.
+      _entries.back().kind |= boundary.kind;
+      continue;
+    }
+    _entries.push_back({textOffset, lastByte, boundary.kind});
+  }
+
+  Log::debug("Built seek index with {} entries from {} word positions.",
+             _entries.size(), words.size());
+}
+
+bool SeekIndex::write(const std::filesystem::path &path) const {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out.good()) {
+    Log::error(L"Couldn't write seek index {}.", path.wstring());
+    return false;
+  }
+
+  IndexHeader header;
+  memcpy(header.magic, IndexMagic, sizeof(IndexMagic));
+  header.count = static_cast<uint32_t>(_entries.size());
+  header.dataOffset = _dataOffset;
+  header.dataLength = _dataLength;
+  header.reserved = 0;
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(_entries.data()),
+            _entries.size() * sizeof(Entry));
+  return out.good();
+}
+
+bool SeekIndex::load(const std::filesystem::path &path) {
+  _entries.clear();
+  std::error_code ec;
+  auto fileSize = std::filesystem::file_size(path, ec);
+  std::ifstream in(path, std::ios::binary);
+  if (ec || !in.good()) {
+    Log::error(L"Couldn't open seek index {}.", path.wstring());
+    return false;
+  }
+
+  IndexHeader header;
+  in.read(reinterpret_cast<char *>(&header), sizeof(header));
+  if (!in.good() || memcmp(header.magic, IndexMagic, sizeof(IndexMagic))) {
+    Log::error(L"{} is not a seek index.", path.wstring());
+    return false;
+  }
+
+  // Check the count against the file before trusting it with a resize.
+  if (fileSize != sizeof(header) + uint64_t(header.count) * sizeof(Entry)) {
+    Log::error(L"Seek index {} is truncated or corrupt.", path.wstring());
+    return false;
+  }
+  _entries.resize(header.count);
+  in.read(reinterpret_cast<char *>(_entries.data()),
+          header.count * sizeof(Entry));
+  if (!in.good()) {
+    Log::error(L"Seek index {} is truncated.", path.wstring());
+    _entries.clear();
+    return false;
+  }
+
+  // lookup() needs entries sorted on both offsets.
+  for (size_t i = 0; i < _entries.size(); ++i) {
+    auto &entry = _entries[i];
+    if (entry.byteOffset > header.dataLength
+        || (i > 0 && (entry.textOffset <= _entries[i - 1].textOffset
+                      || entry.byteOffset < _entries[i - 1].byteOffset))) {
+      Log::error(L"Seek index {} is corrupt.", path.wstring());
+      _entries.clear();
+      return false;
+    }
+  }
+  _dataOffset = header.dataOffset;
+  _dataLength = header.dataLength;
+  return true;
+}
+
+bool SeekIndex::lookup(uint32_t textOffset, Range &range) const {
+  auto it = std::upper_bound(
+    _entries.begin(), _entries.end(), textOffset,
+    [](uint32_t offset, const Entry &e) { return offset < e.textOffset; });
+  if (_entries.empty()) {
+    return false;
+  }
+  if (it == _entries.begin()) {
+    // Leading whitespace belongs to the first segment.
+    ++it;
+  }
+
+  auto &entry = *(it - 1);
+  range.begin = _dataOffset + entry.byteOffset;
+  range.end = _dataOffset
+            + (it != _entries.end() ? it->byteOffset : _dataLength);
+  range.kind = entry.kind;
+  return true;
+}
+
+std::filesystem::path SeekIndex::pathFor(const std::filesystem::path &wavPath) {
+  auto path = wavPath;
+  path += L".idx";
+  return path;
+}
@@ -1,4 +1,5 @@
 #include "sam/tts.h"
+#include "sam/memstats.h"
 #include <sstream>
 #include <iomanip>
 
@@ -52,7 +53,8 @@ STDMETHODIMP NotifySink::AttribChanged(DWORD) {
   return S_OK;
 }
 
-STDMETHODIMP NotifySink::AudioStart(QWORD) {
+STDMETHODIMP NotifySink::AudioStart(QWORD qTimeStamp) {
+  _audioStartTime = qTimeStamp;
   ResetEvent(_finishEvent);
   return S_OK;
 }
@@ -67,6 +69,47 @@ STDMETHODIMP NotifySink::Visual(QWORD, WCHAR, WCHAR, DWORD, PTTSMOUTH) {
   return S_OK;
 }
 
+STDMETHODIMP BufNotifySink::QueryInterface(REFIID riid, LPVOID *ppv) {
+  *ppv = nullptr;
+  if (IsEqualIID(riid, IID_IUnknown)
+      || IsEqualIID(riid, IID_ITTSBufNotifySink)) {
+    *ppv = (LPVOID)this;
+    return S_OK;
+  }
+  return E_NOINTERFACE;
+}
+
+STDMETHODIMP_(ULONG) BufNotifySink::AddRef() {
+  return ++_refcnt;
+}
+
+STDMETHODIMP_(ULONG) BufNotifySink::Release() {
+  if (_refcnt > 1) {
+    return --_refcnt;
+  }
+  _refcnt = 0;
+  delete this;
+  return 0;
+}
+
+STDMETHODIMP BufNotifySink::TextDataDone(QWORD, DWORD) {
+  return S_OK;
+}
+
+STDMETHODIMP BufNotifySink::TextDataStarted(QWORD) {
+  return S_OK;
+}
+
+STDMETHODIMP BufNotifySink::BookMark(QWORD, DWORD) {
+  return S_OK;
+}
+
+STDMETHODIMP BufNotifySink::WordPosition(QWORD qTimeStamp,
+                                         DWORD dwByteOffset) {
+  _wordTimings.push_back({dwByteOffset, qTimeStamp});
+  return S_OK;
+}
+
 HRESULT TTSContainer::init(std::wstring_view name,
                            std::wstring_view outputFilename)
 {
@@ -201,7 +244,7 @@ HRESULT TTSContainer::listVoices() const {
 }
 
 void TTSContainer::say(std::wstring_view text, NotifySink &sink,
-                       WORD pitch, DWORD speed)
+                       WORD pitch, DWORD speed, BufNotifySink *bufSink)
 {
   if (pitch == 0) {
     pitch = _defaultPitch;
@@ -219,6 +262,7 @@ void TTSContainer::say(std::wstring_view text, NotifySink &sink,
     speed = _maxSpeed;
   }
 
+  MemStats::Stage stage{"say"};
   DWORD dwRegKey;
   _ttsCentral->Register((void*)&sink, IID_ITTSNotifySink, &dwRegKey);
   if (isFileOutput()) {
@@ -234,8 +278,9 @@ void TTSContainer::say(std::wstring_view text, NotifySink &sink,
   data.dwSize = text.length() * sizeof(wchar_t);
   data.pData = (void*)text.data();
   _ttsCentral->TextData(CHARSET_TEXT, TTSDATAFLAG_TAGGED, data,
-                        nullptr, IID_ITTSBufNotifySink);
+                        bufSink, IID_ITTSBufNotifySink);
 
+  MemStats::Stage renderStage{"render"};
   MSG msg;
   while (GetMessage(&msg, nullptr, 0, 0)) {
     TranslateMessage(&msg);
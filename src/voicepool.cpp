@@ -0,0 +1,183 @@
+#include "sam/voicepool.h"
+#include "sam/memstats.h"
+
+#include <chrono>
+#include <filesystem>
+#include <cwctype>
+
+namespace {
+
+std::wstring_view trim(std::wstring_view s) {
+  while (!s.empty() && iswspace(s.front())) {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && iswspace(s.back())) {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+void applyMarker(std::wstring_view marker, VoiceSettings &current,
+                 const VoiceSettings &defaults) {
+  marker = trim(marker);
+  if (marker.empty()) {
+    current = defaults;
+    return;
+  }
+
+  while (!marker.empty()) {
+    auto end = marker.find(L';');
+    auto setting = trim(marker.substr(0, end));
+    marker = end == std::wstring_view::npos
+           ? std::wstring_view{} : marker.substr(end + 1);
+    if (setting.empty()) {
+      continue;
+    }
+
+    auto eq = setting.find(L'=');
+    if (eq == std::wstring_view::npos) {
+      current.voice = setting;
+      continue;
+    }
+    auto key = trim(setting.substr(0, eq));
+    auto value = trim(setting.substr(eq + 1));
+    std::wstring number{value};
+    if (key == L"voice") {
+      current.voice = value.empty() ? defaults.voice : std::wstring{value};
+    } else if (key == L"pitch") {
+      current.pitch = value.empty()
+                    ? defaults.pitch : wcstol(number.c_str(), nullptr, 10);
+    } else if (key == L"speed") {
+      current.speed = value.empty()
+                    ? defaults.speed : wcstol(number.c_str(), nullptr, 10);
+    } else {
+      Log::warn(L"Unknown voice marker setting '{}'.", key);
+    }
+  }
+}
+
+} // anonymous namespace
+
+std::vector<VoiceSegment> splitVoiceSegments(std::wstring_view text,
+                                             const VoiceSettings &defaults,
+                                             VoiceSettings &settings)
+{
+  std::vector<VoiceSegment> segments;
+  VoiceSegment current{settings, {}, {}};
+
+  size_t consumed = 0;
+  auto appendText = [&](std::wstring_view piece) {
+    if (!piece.empty()) {
+      current.sourceOffsets.add(static_cast<uint32_t>(current.text.length()),
+                                static_cast<uint32_t>(consumed));
+      current.text += piece;
+    }
+  };
+
+  for (;;) {
+    auto open = text.find(L"[[");
+    auto close = open == std::wstring_view::npos
+               ? open : text.find(L"]]", open + 2);
+    if (close == std::wstring_view::npos) {
+      appendText(text);
+      break;
+    }
+
+    appendText(text.substr(0, open));
+    auto marker = text.substr(open + 2, close - open - 2);
+    text.remove_prefix(close + 2);
+    consumed += close + 2;
+
+    VoiceSettings next = current;
+    applyMarker(marker, next, defaults);
+    if (next == current) {
+      continue;
+    }
+    if (!current.text.empty()) {
+      segments.push_back(std::move(current));
+    }
+    if (!segments.empty() && segments.back() == next) {
+      // Markers that cancel out; keep going with the previous segment.
+      current = std::move(segments.back());
+      segments.pop_back();
+    } else {
+      current = VoiceSegment{std::move(next), {}, {}};
+    }
+  }
+
+  settings = current;
+  if (!current.text.empty() || segments.empty()) {
+    segments.push_back(std::move(current));
+  }
+  return segments;
+}
+
+VoicePool::VoicePool(size_t capacity, std::wstring_view outputFilename)
+  : _capacity{capacity ? capacity : 1}, _outputFilename{outputFilename}
+{}
+
+VoicePool::~VoicePool() {
+  while (!_engines.empty()) {
+    evict();
+  }
+}
+
+VoicePool::Engine *VoicePool::acquire(std::wstring_view voice) {
+  for (auto it = _engines.begin(); it != _engines.end(); ++it) {
+    if (it->voice == voice) {
+      ++_hits;
+      _engines.splice(_engines.begin(), _engines, it);
+      return &_engines.front();
+    }
+  }
+
+  ++_misses;
+  while (_engines.size() >= _capacity) {
+    ++_evictions;
+    evict();
+  }
+
+  MemStats::Stage stage{"init"};
+  _engines.emplace_front();
+  auto &engine = _engines.front();
+  engine.voice = voice;
+  if (isFileOutput()) {
+    engine.partFilename = fmt::format(L"{}.{}.part", _outputFilename,
+                                      _nextPart++);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  HRESULT hr = engine.tts.init(voice, engine.partFilename);
+  std::chrono::duration<double> elapsed =
+    std::chrono::steady_clock::now() - start;
+  _initSeconds += elapsed.count();
+  Log::debug(L"Initialized voice {} in {:.3f}s.", voice, elapsed.count());
+
+  if (FAILED(hr)) {
+    Log::error(L"Couldn't initialize voice {}.", voice);
+    _engines.pop_front();
+    return nullptr;
+  }
+  return &engine;
+}
+
+void VoicePool::evict() {
+  auto partFilename = std::move(_engines.back().partFilename);
+  Log::debug(L"Releasing voice {}.", _engines.back().voice);
+  _engines.pop_back();
+  if (!partFilename.empty()) {
+    std::error_code ec;
+    std::filesystem::remove(partFilename, ec);
+  }
+}
+
+void VoicePool::logStats() const {
+  auto requests = _hits + _misses;
+  if (requests <= 1) {
+    return;
+  }
+  Log::info("Voice pool: {} requests, {} hits ({:.1f}%), {} inits in {:.3f}s "
+            "({:.3f}s each), {} evictions.",
+            requests, _hits, 100.0 * _hits / requests, _misses, _initSeconds,
+            _initSeconds / _misses, _evictions);
+}
@@ -0,0 +1,148 @@
+#include "sam/wav.h"
+#include "sam/sam.h"
+
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+
+namespace {
+
+template<typename T>
+bool readLE(std::ifstream &in, T &value) {
+  in.read(reinterpret_cast<char *>(&value), sizeof(T));
+  return in.good();
+}
+
+template<typename T>
+void writeLE(std::ofstream &out, const T &value) {
+  out.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+} // anonymous namespace
+
+bool readWavInfo(const std::filesystem::path &path, WavInfo &info) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in.good()) {
+    Log::error(L"Couldn't open {}.", path.wstring());
+    return false;
+  }
+
+  char id[4];
+  uint32_t size;
+  char wave[4];
+  if (!in.read(id, 4) || !readLE(in, size) || !in.read(wave, 4)
+      || memcmp(id, "RIFF", 4) || memcmp(wave, "WAVE", 4)) {
+    Log::error(L"{} is not a WAV file.", path.wstring());
+    return false;
+  }
+
+  bool haveFormat = false;
+  while (in.read(id, 4) && readLE(in, size)) {
+    auto chunkStart = static_cast<uint32_t>(in.tellg());
+    if (!memcmp(id, "fmt ", 4)) {
+      if (size < 16
+          || !readLE(in, info.formatTag) || !readLE(in, info.channels)
+          || !readLE(in, info.sampleRate) || !readLE(in, info.byteRate)
+          || !readLE(in, info.blockAlign) || !readLE(in, info.bitsPerSample)) {
+        break;
+      }
+      haveFormat = true;
+    } else if (!memcmp(id, "data", 4)) {
+      if (!haveFormat) {
+        break;
+      }
+      info.dataOffset = chunkStart;
+      info.dataLength = size;
+      // Writers that died before finalizing leave the size unset.
+      in.seekg(0, std::ios::end);
+      auto available = static_cast<uint32_t>(in.tellg()) - chunkStart;
+      if (info.dataLength > available) {
+        info.dataLength = available;
+      }
+      return true;
+    }
+    // Chunks are padded to an even length.
+    in.seekg(chunkStart + size + (size & 1), std::ios::beg);
+  }
+
+  Log::error(L"{} has no usable fmt/data chunks.", path.wstring());
+  return false;
+}
+
+bool sameWavFormat(const WavInfo &a, const WavInfo &b) {
+  return a.formatTag == b.formatTag && a.channels == b.channels
+    && a.sampleRate == b.sampleRate && a.bitsPerSample == b.bitsPerSample;
+}
+
+bool WavWriter::open(const std::filesystem::path &path,
+                     const WavInfo &format)
+{
+  _out.open(path, std::ios::binary | std::ios::trunc);
+  if (!_out.good()) {
+    Log::error(L"Couldn't open {} for writing.", path.wstring());
+    return false;
+  }
+
+  _format = format;
+  _format.dataOffset = 44;
+  _format.dataLength = 0;
+  uint32_t fmtSize = 16;
+  uint32_t zero = 0;
+  _out.write("RIFF", 4);
+  writeLE(_out, zero);
+  _out.write("WAVEfmt ", 8);
+  writeLE(_out, fmtSize);
+  writeLE(_out, _format.formatTag);
+  writeLE(_out, _format.channels);
+  writeLE(_out, _format.sampleRate);
+  writeLE(_out, _format.byteRate);
+  writeLE(_out, _format.blockAlign);
+  writeLE(_out, _format.bitsPerSample);
+  _out.write("data", 4);
+  writeLE(_out, zero);
+  return _out.good();
+}
+
+bool WavWriter::append(const std::filesystem::path &path,
+                       const WavInfo &info)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in.good()) {
+    Log::error(L"Couldn't open {}.", path.wstring());
+    return false;
+  }
+  in.seekg(info.dataOffset, std::ios::beg);
+
+  char buffer[64 * 1024];
+  uint32_t remaining = info.dataLength;
+  while (remaining) {
+    auto count = std::min<uint32_t>(remaining, sizeof(buffer));
+    if (!in.read(buffer, count)) {
+      break;
+    }
+    if (!write(buffer, count)) {
+      return false;
+    }
+    remaining -= count;
+  }
+  return !remaining;
+}
+
+bool WavWriter::write(const void *data, uint32_t length) {
+  _out.write(static_cast<const char *>(data), length);
+  _format.dataLength += length;
+  return _out.good();
+}
+
+bool WavWriter::close() {
+  if (!_out.is_open()) {
+    return true;
+  }
+  uint32_t riffSize = 36 + _format.dataLength;
+  _out.seekp(4, std::ios::beg);
+  writeLE(_out, riffSize);
+  _out.seekp(40, std::ios::beg);
+  writeLE(_out, _format.dataLength);
+  _out.close();
+  return !_out.fail();
+}